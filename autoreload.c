@@ -21,82 +21,436 @@
 
 #if HAVE_INOTIFY
 
-#include <assert.h>
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/inotify.h>
 #include <unistd.h>
 
+/* every watch is one on a directory, which also reports the changes of the
+ * files in it. they are shared by the image being viewed, the thumbnails in
+ * range and the directories of --watch and kept as long as one of them
+ * refers to it.
+ */
+/* a directory can be listed under several names, e.g. given as a relative
+ * path and found by its absolute one, the paths of new files in it are built
+ * from the name that each argument found it by.
+ */
+struct arl_root {
+	char *prefix; /* the directory as named below root */
+	char *root; /* the argument the directory was found in */
+	bool recursive;
+};
+
+struct arl_dir {
+	int wd;
+	char *path;
+	struct arl_root *roots; /* empty if not listed */
+	int rootcnt;
+	int refs; /* by the image being viewed, for its file and its link */
+	unsigned int gen; /* arl->thumbs.gen while it holds files in range */
+};
+
+struct arl_key {
+	char *path;
+	int wd; /* 0: free slot, -1: deleted */
+};
+
 void arl_init(arl_t *arl)
 {
-	arl->fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
-	arl->wd_dir = arl->wd_file = arl->wd_link = arl->wd_link_dir = -1;
+	arl->fd = -1;
+	arl->wd_dir = arl->wd_link_dir = -1;
 	arl->filename = arl->linkname = NULL;
+	arl->dirs = NULL;
+	arl->dircnt = arl->dircap = 0;
+	arl->keys = NULL;
+	arl->keycap = arl->keyused = 0;
+	arl->thumbs.first = arl->thumbs.end = arl->thumbs.cnt = 0;
+	arl->thumbs.wd = NULL;
+	arl->thumbs.gen = 1;
+	arl->thumbs.moved = false;
+
+	if (options->update_cache)
+		return;
+	arl->fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
 	if (arl->fd == -1)
 		error(0, 0, "Could not initialize inotify, no automatic image reloading");
 }
 
+static void arl_dir_free(struct arl_dir *d)
+{
+	int i;
+
+	for (i = 0; i < d->rootcnt; i++) {
+		free(d->roots[i].prefix);
+		free(d->roots[i].root);
+	}
+	free(d->roots);
+	free(d->path);
+}
+
 CLEANUP void arl_cleanup(arl_t *arl)
 {
+	unsigned int i;
+
 	if (arl->fd != -1)
 		close(arl->fd);
 	free(arl->filename);
 	free(arl->linkname);
+	while (arl->dircnt > 0) {
+		arl->dircnt--;
+		arl_dir_free(&arl->dirs[arl->dircnt]);
+	}
+	free(arl->dirs);
+	for (i = 0; i < arl->keycap; i++) {
+		if (arl->keys[i].wd > 0)
+			free(arl->keys[i].path);
+	}
+	free(arl->keys);
+	free(arl->thumbs.wd);
+}
+
+static int dircmp(const void *a, const void *b)
+{
+	int wa = *(const int *)a, wb = ((const struct arl_dir *)b)->wd;
+
+	return (wa > wb) - (wa < wb);
+}
+
+static struct arl_dir *arl_dir_find(arl_t *arl, int wd)
+{
+	if (arl->dircnt == 0)
+		return NULL;
+	return bsearch(&wd, arl->dirs, arl->dircnt, sizeof(*arl->dirs), dircmp);
+}
+
+static unsigned int arl_hash(const char *s)
+{
+	unsigned int h = 2166136261u;
+
+	while (*s != '\0')
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+/* returns the slot of `path` in the hash table of the paths which the
+ * directories have been added by, or the one to insert it into.
+ */
+static struct arl_key *arl_key_find(arl_t *arl, const char *path)
+{
+	unsigned int i;
+	struct arl_key *k, *del = NULL;
+
+	for (i = arl_hash(path);; i++) {
+		k = &arl->keys[i & (arl->keycap - 1)];
+		if (k->wd == 0)
+			return del != NULL ? del : k;
+		if (k->wd == -1) {
+			if (del == NULL)
+				del = k;
+		} else if (STREQ(k->path, path)) {
+			return k;
+		}
+	}
 }
 
-static void rm_watch(int fd, int *wd)
+static void arl_key_add(arl_t *arl, const char *path, int wd)
 {
-	if (*wd != -1) {
-		inotify_rm_watch(fd, *wd);
-		*wd = -1;
+	struct arl_key *k, *old = arl->keys;
+	unsigned int i, n, cap = arl->keycap;
+
+	/* keep at least half of the slots free, dropping the deleted ones */
+	if ((arl->keyused + 1) * 2 > arl->keycap) {
+		for (i = n = 0; i < cap; i++)
+			n += old[i].wd > 0;
+		for (arl->keycap = 64; arl->keycap < (n + 1) * 4; arl->keycap *= 2)
+			;
+		arl->keys = ecalloc(arl->keycap, sizeof(*arl->keys));
+		for (i = 0; i < cap; i++) {
+			if (old[i].wd > 0)
+				*arl_key_find(arl, old[i].path) = old[i];
+		}
+		arl->keyused = n;
+		free(old);
 	}
+	k = arl_key_find(arl, path);
+	if (k->wd == 0)
+		arl->keyused++;
+	k->path = estrdup(path);
+	k->wd = wd;
 }
 
-static void add_watch(int fd, int *wd, const char *path, uint32_t mask)
+static void arl_key_remove(arl_t *arl, int wd)
+{
+	unsigned int i;
+
+	for (i = 0; i < arl->keycap; i++) {
+		if (arl->keys[i].wd == wd) {
+			free(arl->keys[i].path);
+			arl->keys[i].wd = -1;
+		}
+	}
+}
+
+/* returns the entry of directory `path`, after adding a watch for it if it
+ * isn't watched yet. only the first time a path is seen costs a syscall.
+ */
+static struct arl_dir *arl_dir_add(arl_t *arl, const char *path)
 {
-	*wd = inotify_add_watch(fd, path, mask);
-	if (*wd == -1)
+	struct arl_key *k;
+	struct arl_dir *d;
+	int i, wd;
+
+	if (arl->keycap > 0 && (k = arl_key_find(arl, path))->wd > 0)
+		return arl_dir_find(arl, k->wd);
+
+	wd = inotify_add_watch(arl->fd, path, IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO |
+	                       IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR);
+	if (wd == -1) {
 		error(0, errno, "inotify: %s", path);
+		return NULL;
+	}
+	/* a directory can be reached by more than one path */
+	arl_key_add(arl, path, wd);
+	if ((d = arl_dir_find(arl, wd)) != NULL)
+		return d;
+
+	if (arl->dircnt == arl->dircap) {
+		arl->dircap = arl->dircap == 0 ? 16 : arl->dircap * 2;
+		arl->dirs = erealloc(arl->dirs, arl->dircap * sizeof(*arl->dirs));
+	}
+	/* watch descriptors are handed out in increasing order, so this is
+	 * almost always the end of the table
+	 */
+	for (i = arl->dircnt; i > 0 && arl->dirs[i - 1].wd > wd; i--)
+		;
+	d = &arl->dirs[i];
+	memmove(d + 1, d, (arl->dircnt - i) * sizeof(*d));
+	arl->dircnt++;
+	d->wd = wd;
+	d->path = estrdup(path);
+	d->roots = NULL;
+	d->rootcnt = 0;
+	d->refs = 0;
+	d->gen = 0;
+	return d;
+}
+
+static void arl_dir_remove(arl_t *arl, struct arl_dir *d)
+{
+	arl_key_remove(arl, d->wd);
+	arl_dir_free(d);
+	arl->dircnt--;
+	memmove(d, d + 1, (arl->dirs + arl->dircnt - d) * sizeof(*d));
+}
+
+/* stops watching directory `d` once nothing refers to it anymore */
+static void arl_dir_release(arl_t *arl, struct arl_dir *d)
+{
+	if (d->refs == 0 && d->gen != arl->thumbs.gen && d->rootcnt == 0) {
+		inotify_rm_watch(arl->fd, d->wd);
+		arl_dir_remove(arl, d);
+	}
+}
+
+/* references the directory of `path` and returns its watch descriptor,
+ * `name` is set to the name of the file in it.
+ */
+static int arl_ref_basedir(arl_t *arl, const char *path, char **name)
+{
+	const char *base = strrchr(path, '/');
+	char *dir = base != NULL ? estrndup(path, MAX(base - path, 1)) : estrdup(".");
+	struct arl_dir *d = arl_dir_add(arl, dir);
+
+	free(dir);
+	*name = estrdup(base != NULL ? base + 1 : path);
+	if (d == NULL)
+		return -1;
+	d->refs++;
+	return d->wd;
 }
 
-static char *arl_watch_basedir(int fd, int *wd_dir_fd, const char *path)
+static void arl_unref(arl_t *arl, int wd)
 {
-	char dot[] = ".", *base = strrchr(path, '/');
-	char *dir = base != NULL ? estrndup(path, MAX(base - path, 1)) : dot;
-	add_watch(fd, wd_dir_fd, dir, IN_CREATE | IN_MOVED_TO);
-	if (dir != dot)
-		free(dir);
-	return estrdup(base != NULL ? base + 1 : path);
+	struct arl_dir *d;
+
+	if (wd != -1 && (d = arl_dir_find(arl, wd)) != NULL) {
+		d->refs--;
+		arl_dir_release(arl, d);
+	}
 }
 
 void arl_add(arl_t *arl, const fileinfo_t *file)
 {
+	int wd_dir = arl->wd_dir, wd_link_dir = arl->wd_link_dir;
+
 	if (arl->fd == -1)
 		return;
 
-	rm_watch(arl->fd, &arl->wd_dir);
-	rm_watch(arl->fd, &arl->wd_file);
-	rm_watch(arl->fd, &arl->wd_link);
-	rm_watch(arl->fd, &arl->wd_link_dir);
 	free(arl->filename);
-	arl->filename = NULL;
 	free(arl->linkname);
 	arl->linkname = NULL;
+	arl->wd_link_dir = -1;
+
+	/* the old directories are released last, so that moving on within
+	 * one doesn't touch its watch
+	 */
+	arl->wd_dir = arl_ref_basedir(arl, file->path, &arl->filename);
+	if (file->flags & FF_SYMLINK)
+		arl->wd_link_dir = arl_ref_basedir(arl, file->name, &arl->linkname);
+	arl_unref(arl, wd_dir);
+	arl_unref(arl, wd_link_dir);
+}
+
+/* watches directory `path` for files being added to or removed from it,
+ * `root` is the command line or stdin entry which it was found in.
+ */
+void arl_watch_dir(arl_t *arl, const char *path, const char *root, bool recursive)
+{
+	struct arl_dir *d;
+	struct arl_root *r;
+	int i;
+
+	if (arl->fd == -1 || !options->watch || (d = arl_dir_add(arl, path)) == NULL)
+		return;
+	for (i = 0; i < d->rootcnt; i++) {
+		if (STREQ(d->roots[i].prefix, path))
+			return;
+	}
+	d->roots = erealloc(d->roots, (d->rootcnt + 1) * sizeof(*d->roots));
+	r = &d->roots[d->rootcnt++];
+	r->prefix = estrdup(path);
+	r->root = estrdup(root);
+	r->recursive = recursive;
+}
+
+/* returns the watch descriptor of the directory of `name`, which is marked as
+ * holding files of the thumbnail range.
+ */
+static int arl_thumbs_dir(arl_t *arl, const char *name, size_t len)
+{
+	char *dir = len > 0 ? estrndup(name, len) : estrdup(".");
+	struct arl_dir *d = arl_dir_add(arl, dir);
+
+	free(dir);
+	if (d == NULL)
+		return -1;
+	d->gen = arl->thumbs.gen;
+	return d->wd;
+}
+
+static size_t dirlen(const char *name)
+{
+	const char *base = strrchr(name, '/');
+
+	return base != NULL ? (size_t)MAX(base - name, 1) : 0;
+}
+
+/* watches the directories of files[first..end) for their files being
+ * rewritten, so that the thumbnails of the ones in this range are updated,
+ * and the ones of their symlinks for these being replaced. the directories
+ * which only held files of the previous range are dropped.
+ */
+void arl_watch_thumbs(arl_t *arl, int first, int end)
+{
+	int i, n, cnt = end - first, *old = arl->thumbs.wd;
+	int oldcnt = 2 * (arl->thumbs.end - arl->thumbs.first);
+	const char *name, *prev = NULL;
+	size_t len, prevlen = 0;
+	struct arl_dir *d;
+
+	if (arl->fd == -1 || (first == arl->thumbs.first && end == arl->thumbs.end &&
+	                      filecnt == arl->thumbs.cnt && !arl->thumbs.moved))
+	{
+		return;
+	}
+	arl->thumbs.gen++;
+	/* the directories of the files, followed by the ones of their links */
+	arl->thumbs.wd = emalloc(MAX(2 * cnt, 1) * sizeof(*arl->thumbs.wd));
+	for (i = first; i < end; i++) {
+		n = i - first;
+		name = files[i].path != NULL ? files[i].path : files[i].name;
+		len = dirlen(name);
+		if (n > 0 && len == prevlen && memcmp(name, prev, len) == 0) {
+			arl->thumbs.wd[n] = arl->thumbs.wd[n - 1];
+		} else {
+			prev = name;
+			prevlen = len;
+			arl->thumbs.wd[n] = arl_thumbs_dir(arl, name, len);
+		}
+		if (files[i].flags & FF_SYMLINK)
+			arl->thumbs.wd[cnt + n] = arl_thumbs_dir(arl, files[i].name, dirlen(files[i].name));
+		else
+			arl->thumbs.wd[cnt + n] = -1;
+	}
+	for (i = 0; i < oldcnt; i++) {
+		if ((i > 0 && old[i] == old[i - 1]) ||
+		    (d = arl_dir_find(arl, old[i])) == NULL ||
+		    d->gen == arl->thumbs.gen)
+		{
+			continue;
+		}
+		d->gen = 0;
+		arl_dir_release(arl, d);
+	}
+	free(old);
+	arl->thumbs.first = first;
+	arl->thumbs.end = end;
+	arl->thumbs.cnt = filecnt;
+	arl->thumbs.moved = false;
+}
 
-	add_watch(arl->fd, &arl->wd_file, file->path, IN_CLOSE_WRITE | IN_DELETE_SELF);
-	arl->filename = arl_watch_basedir(arl->fd, &arl->wd_dir, file->path);
-	if (file->flags & FF_SYMLINK) {
-		add_watch(arl->fd, &arl->wd_link, file->name,
-		          IN_DELETE_SELF | IN_MOVE_SELF | IN_DONT_FOLLOW);
-		arl->linkname = arl_watch_basedir(arl->fd, &arl->wd_link_dir, file->name);
+/* returns the watch descriptor of the directory of `name`, -1 if it isn't
+ * watched.
+ */
+static int arl_dir_wd(arl_t *arl, const char *name)
+{
+	size_t len = dirlen(name);
+	char *dir = len > 0 ? estrndup(name, len) : estrdup(".");
+	int wd = arl->keycap > 0 ? arl_key_find(arl, dir)->wd : -1;
+
+	free(dir);
+	return wd > 0 ? wd : -1;
+}
+
+/* flags the thumbnails in range of the files called `name` in the directory
+ * with watch descriptor `wd` for being updated. once files have been moved
+ * in the list, the directories of the range no longer line up with them and
+ * are looked up by name until the range is watched again.
+ */
+static bool arl_thumbs_changed(arl_t *arl, int wd, const char *name)
+{
+	int i;
+	bool changed = false;
+	const char *path, *base;
+
+	for (i = arl->thumbs.first; i < MIN(arl->thumbs.end, filecnt); i++) {
+		if (!arl->thumbs.moved && arl->thumbs.wd[i - arl->thumbs.first] != wd)
+			continue;
+		path = files[i].path != NULL ? files[i].path : files[i].name;
+		base = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+		if (STREQ(base, name) && (!arl->thumbs.moved || arl_dir_wd(arl, path) == wd)) {
+			files[i].flags |= FF_TN_NEEDS_UPDATE;
+			changed = true;
+		}
 	}
+	return changed;
 }
 
-bool arl_handle(arl_t *arl)
+/* passes the files which appeared in or vanished from the watched directories
+ * on to the file list and flags the rewritten ones for getting new thumbnails,
+ * `changed` is set if anything of that has happened. returns true if the
+ * image being viewed has to be reloaded.
+ */
+bool arl_handle(arl_t *arl, bool *changed)
 {
-	bool reload = false;
-	char *ptr;
+	bool reload = false, recursive;
+	char *ptr, *path, *root;
+	const char *sep;
+	size_t size;
+	int i;
+	struct arl_dir *d;
 	const struct inotify_event *e;
 	/* inotify_event aligned buffer */
 	static union {
@@ -104,6 +458,9 @@ bool arl_handle(arl_t *arl)
 		struct inotify_event e;
 	} buf;
 
+	*changed = false;
+	if (arl->fd == -1)
+		return false;
 	while (true) {
 		ssize_t len = read(arl->fd, buf.d, sizeof(buf.d));
 
@@ -114,18 +471,45 @@ bool arl_handle(arl_t *arl)
 		}
 		for (ptr = buf.d; ptr < buf.d + len; ptr += sizeof(*e) + e->len) {
 			e = (const struct inotify_event *)ptr;
-			if (e->wd == arl->wd_file && (e->mask & IN_CLOSE_WRITE)) {
+			if ((d = arl_dir_find(arl, e->wd)) == NULL)
+				continue;
+			if (e->mask & IN_IGNORED) {
+				arl_dir_remove(arl, d);
+				file_realpath_invalidate();
+				continue;
+			}
+			if (e->len == 0)
+				continue;
+			/* a symlink or a directory on the way might have been replaced */
+			if (e->mask & (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM))
+				file_realpath_invalidate();
+			if ((e->mask & (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO)) &&
+			    ((e->wd == arl->wd_dir && STREQ(e->name, arl->filename)) ||
+			     (e->wd == arl->wd_link_dir && STREQ(e->name, arl->linkname))))
+			{
 				reload = true;
-			} else if (e->wd == arl->wd_file && (e->mask & IN_DELETE_SELF)) {
-				rm_watch(arl->fd, &arl->wd_file);
-			} else if (e->wd == arl->wd_link && (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) {
-				rm_watch(arl->fd, &arl->wd_link);
-			} else if (e->wd == arl->wd_link_dir && (e->mask & (IN_CREATE | IN_MOVED_TO))) {
-				if (STREQ(e->name, arl->linkname))
-					reload = true;
-			} else if (e->wd == arl->wd_dir && (e->mask & (IN_CREATE | IN_MOVED_TO))) {
-				if (STREQ(e->name, arl->filename))
-					reload = true;
+			}
+			if (d->gen == arl->thumbs.gen && (e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+				*changed |= arl_thumbs_changed(arl, e->wd, e->name);
+			if (!options->include_hidden && e->name[0] == '.')
+				continue;
+			/* adding a directory watches it, which can move the table */
+			for (i = 0; (d = arl_dir_find(arl, e->wd)) != NULL && i < d->rootcnt; i++) {
+				root = d->roots[i].root;
+				recursive = d->roots[i].recursive;
+				sep = d->roots[i].prefix[strlen(d->roots[i].prefix) - 1] == '/' ? "" : "/";
+				size = strlen(d->roots[i].prefix) + strlen(sep) + strlen(e->name) + 1;
+				path = emalloc(size);
+				if (root[0] == '\0') /* files given without a directory part */
+					snprintf(path, size, "%s", e->name);
+				else
+					snprintf(path, size, "%s%s%s", d->roots[i].prefix, sep, e->name);
+
+				if (e->mask & (IN_DELETE | IN_MOVED_FROM))
+					*changed |= drop_entries(path, root, e->mask & IN_ISDIR);
+				else if (!(e->mask & IN_ISDIR) || recursive)
+					*changed |= insert_entry(path, root);
+				free(path);
 			}
 		}
 	}
@@ -150,10 +534,26 @@ void arl_add(arl_t *arl, const fileinfo_t *file)
 	(void)file;
 }
 
-bool arl_handle(arl_t *arl)
+bool arl_handle(arl_t *arl, bool *changed)
 {
 	(void)arl;
+	*changed = false;
 	return false;
 }
 
+void arl_watch_dir(arl_t *arl, const char *path, const char *root, bool recursive)
+{
+	(void)arl;
+	(void)path;
+	(void)root;
+	(void)recursive;
+}
+
+void arl_watch_thumbs(arl_t *arl, int first, int end)
+{
+	(void)arl;
+	(void)first;
+	(void)end;
+}
+
 #endif /* HAVE_INOTIFY */
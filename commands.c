@@ -120,6 +120,7 @@ bool cg_prefix_external(arg_t _)
 
 bool cg_reload_image(arg_t _)
 {
+	file_realpath_invalidate();
 	if (mode == MODE_IMAGE) {
 		load_image(fileidx);
 	} else {
@@ -230,6 +231,8 @@ static bool change_color_modifier(arg_t d, int *target)
 {
 	if (!img_change_color_modifier(&img, d * (prefix > 0 ? prefix : 1), target))
 		return false;
+	if (tns.thumbs != NULL)
+		tns_atlas_reset(&tns);
 	if (mode == MODE_THUMB)
 		tns.dirty = true;
 	return true;
@@ -417,6 +420,7 @@ bool ct_move_sel(arg_t dir)
 
 bool ct_reload_all(arg_t _)
 {
+	file_realpath_invalidate();
 	tns_free(&tns);
 	tns_init(&tns, files, &filecnt, &fileidx, &win);
 	tns.dirty = true;
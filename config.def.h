@@ -57,6 +57,12 @@ static const int CACHE_SIZE_MEM_PERCENTAGE = 3;          /* use 3% of total memo
 static const int CACHE_SIZE_LIMIT = 256 * 1024 * 1024;   /* but not above 256MiB */
 static const int CACHE_SIZE_FALLBACK = 32 * 1024 * 1024; /* fallback to 32MiB if we can't determine total memory */
 
+/* if true, the first bytes of each file are checked while building the file
+ * list, and the ones which are known not to be images (e.g. executables,
+ * archives, videos, text) are left out instead of being tried by all loaders.
+ */
+static const bool SNIFF_FILES = true;
+
 #endif
 #ifdef INCLUDE_OPTIONS_CONFIG
 
@@ -70,6 +76,16 @@ static const bool ANTI_ALIAS = true;
  */
 static const bool ALPHA_LAYER = false;
 
+/* if true, sort the files of a directory by the numeric value of the digits
+ * in their names, e.g. img2 before img10 (overwritten via `--natural-sort`)
+ */
+static const bool NATURAL_SORT = false;
+
+/* if true, files created in or removed from the directories given on the
+ * command line are added to or removed from the list (overwritten via `--watch`)
+ */
+static const bool WATCH_DIRS = false;
+
 /* list of whitelisted/blacklisted directory for thumbnail cache
  * (overwritten via --cache-{allow,deny} option).
  * see THUMBNAIL CACHING section in nsxiv(1) manpage for more details.
@@ -87,6 +103,43 @@ static const int thumb_sizes[] = { 32, 64, 96, 128, 160 };
 /* thumbnail size at startup, index into thumb_sizes[]: */
 static const int THUMB_SIZE = 3;
 
+/* number of screens ahead of the view (in the direction it last moved to)
+ * to cache before caching the rest of the files outward from the selection
+ */
+static const int THUMB_LOOKAHEAD = 2;
+
+/* number of screens of thumbnails around the current image to load into
+ * memory while idle in image mode, at most half of THUMB_RETAIN. the
+ * thumbnails of all other files are only written to the cache. -1 disables
+ * creating thumbnails in image mode.
+ */
+static const int THUMB_PREFETCH = 1;
+
+/* number of screens worth of thumbnails, in addition to the visible ones, to
+ * keep in memory after they have been scrolled out of view. the least
+ * recently visible ones are dropped first.
+ */
+static const int THUMB_RETAIN = 3;
+
+/* if true, thumbnails without an alpha channel are kept in memory with 16 bits
+ * per pixel (dithered RGB565) and only expanded to full color when they are
+ * drawn, which halves the memory they take up.
+ */
+static const bool THUMB_COMPACT = false;
+
+/* if true, also key the thumbnail cache by a hash of the size, head and tail
+ * of each file, so that renamed, moved or duplicated files reuse their
+ * thumbnails. files which only differ in the middle will share a thumbnail.
+ */
+static const bool THUMB_CACHE_CONTENT = false;
+
+/* maximum size of the thumbnail cache in MiB and number of thumbnails, 0
+ * means unlimited. the least recently used thumbnails are removed in the
+ * background when a limit is exceeded.
+ */
+static const int THUMB_CACHE_SIZE = 0;
+static const int THUMB_CACHE_FILES = 0;
+
 #endif
 #ifdef INCLUDE_MAPPINGS_CONFIG
 
@@ -15,6 +15,7 @@ HAVE_INOTIFY = $(OPT_DEP_DEFAULT)
 # optional dependencies, see README for more info
 HAVE_LIBFONTS = $(OPT_DEP_DEFAULT)
 HAVE_LIBEXIF  = $(OPT_DEP_DEFAULT)
+HAVE_LIBJPEG  = $(OPT_DEP_DEFAULT)
 
 # CFLAGS, any additional compiler flags goes here
 CFLAGS = -Wall -pedantic -O2 -DNDEBUG
@@ -23,7 +23,9 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -32,6 +34,10 @@
 #if HAVE_LIBEXIF
 #include <libexif/exif-data.h>
 #endif
+#if HAVE_LIBJPEG
+#include <jpeglib.h>
+#include <setjmp.h>
+#endif
 
 enum { DEF_ANIM_DELAY = 75 };
 
@@ -254,6 +260,102 @@ static bool img_load_multiframe(img_t *img, const fileinfo_t *file)
 	return m->cnt > 0;
 }
 
+/* signatures of common files which are no images, imlib2 has loaders for
+ * compressed images, images in id3 tags and y4m videos though.
+ */
+static const struct {
+	int off;
+	int len;
+	const char *magic;
+} nonimages[] = {
+	{ 0,  4, "\x7f" "ELF" },
+	{ 0,  2, "MZ" },
+	{ 0,  4, "\xca\xfe\xba\xbe" },
+	{ 0,  4, "\xcf\xfa\xed\xfe" },
+	{ 0,  7, "!<arch>" },
+	{ 0,  4, "PK\x03\x04" },
+	{ 0,  4, "Rar!" },
+	{ 0,  6, "7z\xbc\xaf\x27\x1c" },
+	{ 0,  4, "%PDF" },
+	{ 0, 16, "SQLite format 3" },
+	{ 0,  4, "\x1a\x45\xdf\xa3" }, /* matroska, webm */
+	{ 0,  4, "\x00\x00\x01\xba" }, /* mpeg */
+	{ 0,  4, "\x00\x00\x01\xb3" },
+	{ 0,  4, "OggS" },
+	{ 0,  4, "fLaC" },
+	{ 8,  4, "WAVE" }, /* riff */
+	{ 8,  4, "AVI " }
+};
+
+/* brands of iso media files, which hold heif or avif images */
+static const char *const heifbrands[] = {
+	"heic", "heix", "heim", "heis", "hevc", "hevx", "mif1", "msf1", "avif", "avis"
+};
+
+/* beginnings of text files which imlib2 may load */
+static const char *const textimages[] = {
+	"/* XPM */", "<", "#define", "%!", "P1", "P2", "P3", "P4", "P5", "P6", "P7", "YUV4MPEG2", "ARGB "
+};
+
+/* returns false for files which, going by their first bytes, are certainly
+ * no images and should not be added to the file list.
+ */
+bool img_sniff(const char *path)
+{
+	unsigned char buf[32];
+	const unsigned char *p = buf;
+	unsigned int i;
+	ssize_t n;
+	int fd;
+
+	if (!SNIFF_FILES)
+		return true;
+	/* leave the error messages of unreadable files to img_open() */
+	if ((fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		return true;
+	n = read(fd, buf, sizeof(buf));
+	close(fd);
+	if (n < 0)
+		return true;
+	if (n == 0)
+		return false;
+
+	for (i = 0; i < ARRLEN(nonimages); i++) {
+		if (n >= nonimages[i].off + nonimages[i].len &&
+		    memcmp(buf + nonimages[i].off, nonimages[i].magic, nonimages[i].len) == 0)
+		{
+			return false;
+		}
+	}
+	if (n >= 12 && memcmp(buf + 4, "ftyp", 4) == 0) {
+		for (i = 0; i < ARRLEN(heifbrands); i++) {
+			if (memcmp(buf + 8, heifbrands[i], 4) == 0)
+				return true;
+		}
+		return false; /* mp4, mov, 3gp, ... */
+	}
+
+	for (i = 0; i < (unsigned int)n; i++) {
+		/* control characters or bytes which never occur in utf-8 */
+		if ((buf[i] < 0x20 && buf[i] != '\t' && buf[i] != '\n' && buf[i] != '\r') ||
+		    buf[i] == 0xc0 || buf[i] == 0xc1 || buf[i] >= 0xf8)
+		{
+			return true; /* binary, unknown */
+		}
+	}
+	if (n >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0)
+		p += 3;
+	while (p < buf + n && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+		p++;
+	for (i = 0; i < ARRLEN(textimages); i++) {
+		size_t len = strlen(textimages[i]);
+
+		if (len <= (size_t)(buf + n - p) && memcmp(p, textimages[i], len) == 0)
+			return true;
+	}
+	return false;
+}
+
 Imlib_Image img_open(const fileinfo_t *file)
 {
 	struct stat st;
@@ -281,6 +383,117 @@ Imlib_Image img_open(const fileinfo_t *file)
 	return im;
 }
 
+#if HAVE_LIBJPEG
+struct jpeg_err {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jmp;
+};
+
+static void img_jpeg_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((struct jpeg_err *)cinfo->err)->jmp, 1);
+}
+
+static void img_jpeg_output_message(j_common_ptr cinfo)
+{
+	/* errors are reported by imlib2 when falling back to it */
+}
+
+/* decodes a jpeg at the smallest of the scales 1/2, 1/4 or 1/8 supported by
+ * libjpeg's IDCT, which still covers `size`. returns NULL if the file isn't
+ * a jpeg, can't be reduced or libjpeg fails to decode it.
+ */
+static Imlib_Image img_open_jpeg(const char *path, int size)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_err jerr;
+	unsigned char magic[3];
+	unsigned int denom, maxwh, x;
+	JSAMPROW volatile row = NULL;
+	DATA32 *data, *p;
+	FILE *fp;
+	Imlib_Image volatile im = NULL;
+
+	if ((fp = fopen(path, "rb")) == NULL)
+		return NULL;
+	if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+	    magic[0] != 0xFF || magic[1] != 0xD8 || magic[2] != 0xFF)
+	{
+		fclose(fp);
+		return NULL;
+	}
+	rewind(fp);
+
+	cinfo.err = jpeg_std_error(&jerr.mgr);
+	jerr.mgr.error_exit = img_jpeg_error_exit;
+	jerr.mgr.output_message = img_jpeg_output_message;
+	if (setjmp(jerr.jmp)) {
+		if (im != NULL) {
+			imlib_context_set_image(im);
+			imlib_free_image();
+		}
+		free(row);
+		jpeg_destroy_decompress(&cinfo);
+		fclose(fp);
+		return NULL;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, fp);
+	jpeg_read_header(&cinfo, TRUE);
+
+	maxwh = MAX(cinfo.image_width, cinfo.image_height);
+	for (denom = 8; denom > 1 && (maxwh + denom - 1) / denom < (unsigned int)size; denom /= 2)
+		;
+	if (denom == 1)
+		longjmp(jerr.jmp, 1);
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = denom;
+	cinfo.out_color_space = JCS_RGB;
+	cinfo.dct_method = JDCT_IFAST;
+	jpeg_start_decompress(&cinfo);
+
+	if ((im = imlib_create_image(cinfo.output_width, cinfo.output_height)) == NULL)
+		longjmp(jerr.jmp, 1);
+	row = emalloc(cinfo.output_width * cinfo.output_components);
+	imlib_context_set_image(im);
+	p = data = imlib_image_get_data();
+	while (cinfo.output_scanline < cinfo.output_height) {
+		JSAMPROW rows[1];
+
+		rows[0] = row;
+		jpeg_read_scanlines(&cinfo, rows, 1);
+		for (x = 0; x < cinfo.output_width; x++) {
+			*p++ = 0xFF000000 | (DATA32)row[x * 3] << 16 |
+			          (DATA32)row[x * 3 + 1] << 8 | row[x * 3 + 2];
+		}
+	}
+	imlib_image_put_back_data(data);
+	imlib_image_set_has_alpha(0);
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	free(row);
+	fclose(fp);
+	return im;
+}
+#endif /* HAVE_LIBJPEG */
+
+/* like img_open(), but the image may be decoded at a reduced resolution
+ * which is still at least `size` pixels wide or high.
+ */
+Imlib_Image img_open_thumb(const fileinfo_t *file, int size)
+{
+#if HAVE_LIBJPEG
+	const char *path;
+	Imlib_Image im;
+
+	if ((path = file_realpath(file, 1)) != NULL && (im = img_open_jpeg(path, size)) != NULL) {
+		imlib_context_set_image(im);
+		return im;
+	}
+#endif
+	return img_open(file);
+}
+
 bool img_load(img_t *img, const fileinfo_t *file)
 {
 	const char *fmt;
@@ -319,6 +532,26 @@ bool img_load(img_t *img, const fileinfo_t *file)
 	return true;
 }
 
+/* decodes the image of `file` ahead of time and holds on to it until the next
+ * call, so that a following img_load() of it is served from imlib2's cache.
+ * returns false if it can't be decoded.
+ */
+bool img_predecode(const fileinfo_t *file)
+{
+	static Imlib_Image held;
+
+	img_free(held, false);
+	held = NULL;
+	if (file != NULL && (held = img_open(file)) != NULL) {
+		imlib_image_set_changes_on_disk();
+		if (imlib_image_get_data_for_reading_only() == NULL) {
+			img_free(held, true);
+			held = NULL;
+		}
+	}
+	return held != NULL;
+}
+
 CLEANUP void img_free(Imlib_Image im, bool decache)
 {
 	if (im != NULL) {
@@ -43,6 +43,7 @@
 #include <X11/keysym.h>
 
 #define MODMASK(mask) (USED_MODMASK & (mask))
+#define ISDIGIT(c) ((c) >= '0' && (c) <= '9')
 #define BAR_SEP "  "
 
 #define TV_DIFF(t1,t2) (((t1)->tv_sec  - (t2)->tv_sec ) * 1000 + \
@@ -74,9 +75,48 @@ int prefix;
 const XButtonEvent *xbutton_ev;
 
 static void autoreload(void);
+static void prefetch_thumbs(void);
+static void predecode(void);
 
 static bool extprefix;
 static bool resized = false;
+static bool idle = false;
+static int filecap;
+static int removed; /* number of files flagged FF_REMOVED */
+
+/* the entries which are added from the main loop after startup */
+static struct {
+	int fd; /* stdin while it is read, -1 afterwards */
+	char *buf;
+	size_t len, cap;
+	int arg; /* next command line argument to add */
+} input;
+
+/* the files which were added from each watched argument, new files below it
+ * are inserted among these in sorted order. its range also holds the files of
+ * other arguments if these were given in between.
+ */
+static struct {
+	struct root {
+		char *name; /* empty for the files without a directory part */
+		int lo, hi;
+		bool sorted;
+	} *r;
+	int cnt, cap;
+} roots;
+
+static struct {
+	int sel;
+	bool pending;
+} dwell = { -1, false };
+
+/* the changes to the image being viewed, which is reloaded once they stop */
+static struct {
+	struct timeval last;
+	int gap; /* average time between them, 0 if not known yet */
+	off_t size;
+	struct timespec mtime;
+} changes;
 
 static struct {
 	extcmd_t f, ft;
@@ -94,12 +134,14 @@ static struct {
 	struct timeval when;
 	bool active;
 } timeouts[] = {
-	{ autoreload   },
-	{ redraw       },
-	{ reset_cursor },
-	{ slideshow    },
-	{ animate      },
-	{ clear_resize },
+	{ autoreload      },
+	{ redraw          },
+	{ reset_cursor    },
+	{ slideshow       },
+	{ animate         },
+	{ clear_resize    },
+	{ prefetch_thumbs },
+	{ predecode       },
 };
 
 /*
@@ -114,52 +156,191 @@ static void cleanup(void)
 	win_close(&win);
 }
 
-static bool xgetline(char **lineptr, size_t *n)
-{
-	ssize_t len = getdelim(lineptr, n, options->using_null ? '\0' : '\n', stdin);
-	if (!options->using_null && len > 0 && (*lineptr)[len - 1] == '\n')
-		(*lineptr)[len - 1] = '\0';
-	return len > 0;
-}
-
 static int zoom_to_percent(float zoom)
 {
 	float round = 0.5f;
 	return (int)(zoom * 100.0f + round);
 }
 
-static int fncmp(const void *a, const void *b)
+typedef struct {
+	char *key;
+	fileinfo_t file;
+} sortent_t;
+
+/* returns the strxfrm() collation key of `name`. for the natural ordering,
+ * runs of digits are prefixed by their length beforehand, so that "img2" is
+ * sorted before "img10".
+ */
+static char *sort_key(const char *name)
+{
+	const char *p, *q;
+	char *s = NULL, *key;
+	size_t i = 0, n;
+
+	if (options->natural_sort) {
+		s = emalloc(strlen(name) * 2 + 1);
+		for (p = name; *p != '\0'; p = q) {
+			if (!ISDIGIT(*p)) {
+				s[i++] = *p;
+				q = p + 1;
+				continue;
+			}
+			while (*p == '0' && ISDIGIT(p[1]))
+				p++;
+			for (q = p; ISDIGIT(*q); q++)
+				;
+			for (n = q - p; n >= 9; n -= 9)
+				s[i++] = '9';
+			s[i++] = '0' + n;
+			memcpy(s + i, p, q - p);
+			i += q - p;
+		}
+		s[i] = '\0';
+		name = s;
+	}
+	n = strxfrm(NULL, name, 0) + 1;
+	key = emalloc(n);
+	strxfrm(key, name, n);
+	free(s);
+	return key;
+}
+
+static int sortcmp(const void *a, const void *b)
+{
+	const sortent_t *ea = a, *eb = b;
+	int r = strcmp(ea->key, eb->key);
+
+	return r != 0 ? r : strcmp(ea->file.name, eb->file.name);
+}
+
+/* sorts files[start..end) by their collation keys, which are computed once
+ * per file instead of strcoll() doing so on every comparison.
+ */
+static void sort_files(int start, int end)
 {
-	return strcoll(((fileinfo_t *)a)->name, ((fileinfo_t *)b)->name);
+	int i, cnt = end - start;
+	sortent_t *ent = emalloc(cnt * sizeof(*ent));
+
+	for (i = 0; i < cnt; i++) {
+		ent[i].file = files[start + i];
+		ent[i].key = sort_key(ent[i].file.name);
+	}
+	qsort(ent, cnt, sizeof(*ent), sortcmp);
+	for (i = 0; i < cnt; i++) {
+		files[start + i] = ent[i].file;
+		free(ent[i].key);
+	}
+	free(ent);
 }
 
 static void check_add_file(const char *filename, bool given)
 {
 	if (*filename == '\0')
 		return;
+	if (!options->assume_files && !img_sniff(filename)) {
+		if (given)
+			error(0, 0, "%s: Not an image file", filename);
+		return;
+	}
+
+	if (filecnt == filecap) {
+		filecap *= 2;
+		files = erealloc(files, filecap * sizeof(*files));
+		memset(&files[filecap / 2], 0, filecap / 2 * sizeof(*files));
+		tns.files = files;
+	}
+
+	files[filecnt].name = arena_strndup(filename, strlen(filename));
+	files[filecnt].path = NULL;
+	/* the slot may hold a stale copy of a file which was moved down */
+	files[filecnt].flags = given ? FF_WARN : 0;
+	files[filecnt].pathgen = 0;
+	filecnt++;
+}
+
+/* compares the file called `name` with collation key `key` to file `n` */
+static int filecmp(const char *key, const char *name, int n)
+{
+	char *k = sort_key(files[n].name);
+	int r = strcmp(key, k);
+
+	free(k);
+	return r != 0 ? r : strcmp(name, files[n].name);
+}
 
-	if (fileidx == filecnt) {
-		filecnt *= 2;
-		files = erealloc(files, filecnt * sizeof(*files));
-		memset(&files[filecnt / 2], 0, filecnt / 2 * sizeof(*files));
+static struct root *find_root(const char *name)
+{
+	int i;
+
+	/* the files given on their own mostly share the last one */
+	for (i = roots.cnt; i > 0; i--) {
+		if (STREQ(roots.r[i - 1].name, name))
+			return &roots.r[i - 1];
 	}
+	return NULL;
+}
+
+/* extends the range of the watched argument `name` by files[start..filecnt) */
+static struct root *add_root(const char *name, int start)
+{
+	struct root *r = find_root(name);
+	char *key;
+
+	if (!options->watch || (r != NULL && start == filecnt))
+		return r;
+	if (r == NULL) {
+		if (roots.cnt == roots.cap) {
+			roots.cap = roots.cap == 0 ? 16 : roots.cap * 2;
+			roots.r = erealloc(roots.r, roots.cap * sizeof(*roots.r));
+		}
+		r = &roots.r[roots.cnt++];
+		r->name = estrdup(name);
+		r->lo = start;
+		r->sorted = true;
+	} else if (r->lo == r->hi) {
+		r->lo = start;
+	} else if (r->hi != start) {
+		r->sorted = false;
+	} else {
+		key = sort_key(files[start].name);
+		if (filecmp(key, files[start].name, r->hi - 1) < 0)
+			r->sorted = false;
+		free(key);
+	}
+	r->hi = filecnt;
+	return r;
+}
+
+/* watches the directory of the file `name` given on its own, new files in it
+ * are named like it: without a directory part if it has none.
+ */
+static void watch_parent(const char *name, int start)
+{
+	const char *base = strrchr(name, '/');
+	char *dir;
 
-	files[fileidx].name = estrdup(filename);
-	files[fileidx].path = NULL;
-	if (given)
-		files[fileidx].flags |= FF_WARN;
-	fileidx++;
+	if (base == NULL) {
+		arl_watch_dir(&arl, ".", "", false);
+		add_root("", start);
+	} else {
+		dir = estrndup(name, MAX(base - name, 1)); /* account for "/file" */
+		arl_watch_dir(&arl, dir, dir, false);
+		add_root(dir, start);
+		free(dir);
+	}
 }
 
 static void add_entry(const char *entry_name)
 {
-	int start;
-	char *filename;
+	int start = filecnt;
+	char *filename, *subdir;
 	struct stat fstats;
 	r_dir_t dir;
 
 	if (options->assume_files) {
 		check_add_file(entry_name, true);
+		if (filecnt > start)
+			watch_parent(entry_name, start);
 		return;
 	}
 
@@ -169,49 +350,142 @@ static void add_entry(const char *entry_name)
 	}
 	if (!S_ISDIR(fstats.st_mode)) {
 		check_add_file(entry_name, true);
+		if (filecnt > start)
+			watch_parent(entry_name, start);
 	} else {
 		if (r_opendir(&dir, entry_name, options->recursive) < 0) {
 			error(0, errno, "%s", entry_name);
 			return;
 		}
-		start = fileidx;
+		arl_watch_dir(&arl, entry_name, entry_name, options->recursive);
+		subdir = dir.name;
 		while ((filename = r_readdir(&dir, options->include_hidden)) != NULL) {
+			if (dir.name != subdir) {
+				subdir = dir.name;
+				arl_watch_dir(&arl, subdir, entry_name, true);
+			}
 			check_add_file(filename, false);
 			free(filename);
 		}
 		r_closedir(&dir);
-		if (fileidx - start > 1)
-			qsort(files + start, fileidx - start, sizeof(*files), fncmp);
+		if (filecnt - start > 1)
+			sort_files(start, filecnt);
+		add_root(entry_name, start);
+	}
+}
+
+static bool input_pending(void)
+{
+	return input.fd != -1 || input.arg < options->filecnt;
+}
+
+static bool input_ready(void)
+{
+	struct pollfd pfd;
+
+	if (input.fd == -1)
+		return input.arg < options->filecnt;
+	pfd.fd = input.fd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/* adds the entries of what is available on stdin while it is open and the
+ * next command line argument afterwards, blocks if nothing is available.
+ */
+static void read_input(void)
+{
+	const char delim = options->using_null ? '\0' : '\n';
+	char *line, *end;
+	ssize_t n;
+
+	if (input.fd == -1) {
+		if (input.arg < options->filecnt)
+			add_entry(options->filenames[input.arg++]);
+		return;
+	}
+	if (input.cap - input.len < BUFSIZ) {
+		input.cap = MAX(input.cap * 2, 4 * BUFSIZ);
+		input.buf = erealloc(input.buf, input.cap);
+	}
+	if ((n = read(input.fd, input.buf + input.len, input.cap - input.len - 1)) < 0 &&
+	    (errno == EINTR || errno == EAGAIN))
+	{
+		return;
+	}
+	if (n <= 0) {
+		if (n < 0)
+			error(0, errno, "stdin");
+		if (input.len > 0) {
+			input.buf[input.len] = '\0';
+			add_entry(input.buf);
+		}
+		free(input.buf);
+		input.buf = NULL;
+		input.len = input.cap = 0;
+		input.fd = -1;
+		return;
+	}
+	input.len += n;
+	for (line = input.buf; (end = memchr(line, delim, input.buf + input.len - line)) != NULL;
+	     line = end + 1)
+	{
+		*end = '\0';
+		add_entry(line);
 	}
+	input.len -= line - input.buf;
+	memmove(input.buf, line, input.len);
+}
+
+static void free_file(const fileinfo_t *file)
+{
+	if (file->path != file->name)
+		arena_free(file->path);
+	arena_free(file->name);
 }
 
 void remove_file(int n, bool manual)
 {
+	int i;
+
 	if (n < 0 || n >= filecnt)
 		return;
 
-	if (filecnt == 1) {
-		if (!manual)
-			fprintf(stderr, "%s: no more files to display, aborting\n", progname);
-		exit(manual ? EXIT_SUCCESS : EXIT_FAILURE);
+	if (files[n].flags & FF_REMOVED) {
+		removed--;
+	} else {
+		while (filecnt - removed == 1 && input_pending())
+			read_input();
+		if (filecnt - removed == 1) {
+			if (!manual)
+				fprintf(stderr, "%s: no more files to display, aborting\n", progname);
+			exit(manual ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
 	}
 	if (files[n].flags & FF_MARK)
 		markcnt--;
 
-	free((void *)files[n].path);
-	free((void *)files[n].name);
 	if (tns.thumbs != NULL)
-		tns_unload(&tns, n);
+		tns_remove(&tns, n);
 
-	if (n + 1 < filecnt) {
-		if (tns.thumbs != NULL) {
-			memmove(tns.thumbs + n, tns.thumbs + n + 1,
-			        (filecnt - n - 1) * sizeof(*tns.thumbs));
-			memset(tns.thumbs + filecnt - 1, 0, sizeof(*tns.thumbs));
-		}
+	free_file(&files[n]);
+	if (n + 1 < filecnt)
 		memmove(files + n, files + n + 1, (filecnt - n - 1) * sizeof(*files));
-	}
 	filecnt--;
+	arl.thumbs.moved = true;
+	for (i = 0; i < roots.cnt; i++) {
+		roots.r[i].lo -= roots.r[i].lo > n;
+		roots.r[i].hi -= roots.r[i].hi > n;
+	}
+	if (tns.thumbs != NULL) {
+		/* keep the background caching cursors on the same files */
+		if (tns.init.hi > n)
+			tns.init.hi--;
+		if (tns.init.lo >= n)
+			tns.init.lo--;
+		if (tns.init.sel > n)
+			tns.init.sel--;
+	}
 	if (fileidx > n || fileidx == filecnt)
 		fileidx--;
 	if (alternate > n || alternate == filecnt)
@@ -220,6 +494,216 @@ void remove_file(int n, bool manual)
 		markidx--;
 }
 
+/* flags file `n` as removed without moving the ones after it, which is left
+ * to the next compact_files(). the last remaining file is removed right away.
+ */
+static void tombstone_file(int n)
+{
+	if (filecnt - removed == 1) {
+		remove_file(n, false);
+		return;
+	}
+	if (files[n].flags & FF_MARK)
+		markcnt--;
+	if (tns.thumbs != NULL)
+		tns_unload(&tns, n);
+	files[n].flags = (files[n].flags & ~FF_MARK) | FF_REMOVED | FF_TN_INIT;
+	removed++;
+}
+
+/* takes the files flagged by tombstone_file() out of the list in one pass,
+ * every index into it is moved along with the file it refers to.
+ */
+void compact_files(void)
+{
+	int i, j, *map;
+
+	if (removed == 0)
+		return;
+	if (tns.thumbs != NULL)
+		tns_remove_flagged(&tns);
+
+	/* map[i] is the new index of file i, or of the next kept one after it */
+	map = emalloc((filecnt + 1) * sizeof(*map));
+	for (i = j = 0; i < filecnt; i++) {
+		map[i] = j;
+		if (!(files[i].flags & FF_REMOVED))
+			files[j++] = files[i];
+		else
+			free_file(&files[i]);
+	}
+	map[filecnt] = j;
+	arena_compact(files, j);
+
+	if (tns.thumbs != NULL) {
+		tns.init.hi = map[tns.init.hi];
+		tns.init.lo = map[tns.init.lo + 1] - 1;
+		if (tns.init.sel >= 0)
+			tns.init.sel = map[tns.init.sel];
+		tns.loadnext = map[MIN(tns.loadnext, filecnt)];
+		tns.first = map[tns.first];
+		tns.dirty = true;
+	}
+	fileidx = MIN(map[fileidx], j - 1);
+	alternate = MIN(map[alternate], j - 1);
+	markidx = MIN(map[markidx], j - 1);
+	for (i = 0; i < roots.cnt; i++) {
+		roots.r[i].lo = map[roots.r[i].lo];
+		roots.r[i].hi = map[roots.r[i].hi];
+	}
+	filecnt = j;
+	removed = 0;
+	arl.thumbs.moved = true;
+	free(map);
+}
+
+/* returns the position of the first file not ordered before `name` in the
+ * range of `r`, which is only meaningful if it is sorted.
+ */
+static int lower_bound(const struct root *r, const char *name)
+{
+	int lo = r->lo, hi = r->hi, mid;
+	char *key = sort_key(name);
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (filecmp(key, name, mid) > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	free(key);
+	return lo;
+}
+
+/* returns the index of the file `name` in the range of `r`, or -1 if it is not
+ * in it or has been removed.
+ */
+static int find_file(const struct root *r, const char *name)
+{
+	int i = r->sorted ? lower_bound(r, name) : r->lo;
+
+	for (; i < r->hi; i++) {
+		if (STREQ(files[i].name, name) && !(files[i].flags & FF_REMOVED))
+			return i;
+		if (r->sorted && !STREQ(files[i].name, name))
+			break;
+	}
+	return -1;
+}
+
+/* adds the new file `name` to the range of the watched argument `root`, in
+ * sorted order if the range is.
+ */
+static bool insert_file(const char *name, const char *root)
+{
+	int i, n, pos;
+	struct root *r;
+	fileinfo_t file;
+
+	if ((r = find_root(root)) == NULL)
+		r = add_root(root, filecnt);
+	if (r == NULL || find_file(r, name) >= 0)
+		return false;
+	pos = r->sorted ? lower_bound(r, name) : r->hi;
+	n = filecnt;
+	check_add_file(name, false);
+	if (filecnt == n)
+		return false;
+
+	file = files[n];
+	memmove(files + pos + 1, files + pos, (n - pos) * sizeof(*files));
+	files[pos] = file;
+	r->hi++;
+	for (i = 0; i < roots.cnt; i++) {
+		if (&roots.r[i] == r)
+			continue;
+		if (roots.r[i].lo >= pos) {
+			roots.r[i].lo++;
+			roots.r[i].hi++;
+		} else if (roots.r[i].hi > pos) {
+			roots.r[i].hi++;
+		}
+	}
+	/* the watched thumbnail range no longer lines up with the list */
+	arl.thumbs.moved = true;
+	if (tns.thumbs != NULL) {
+		tns_insert(&tns, pos);
+		/* let the loading start over from the selection to pick it up */
+		tns.init.sel = -1;
+		tns.dirty = true;
+	}
+	if (fileidx >= pos)
+		fileidx++;
+	if (alternate >= pos)
+		alternate++;
+	if (markidx >= pos)
+		markidx++;
+	return true;
+}
+
+/* adds file `name`, which appeared below the watched directory argument
+ * `root`, or all files in it if it is a directory. returns true if any
+ * has been added.
+ */
+bool insert_entry(const char *name, const char *root)
+{
+	bool added = false;
+	char *filename, *subdir;
+	struct stat fstats;
+	r_dir_t dir;
+
+	if (stat(name, &fstats) < 0)
+		return false;
+	if (!S_ISDIR(fstats.st_mode))
+		return insert_file(name, root);
+
+	if (r_opendir(&dir, name, true) < 0)
+		return false;
+	arl_watch_dir(&arl, name, root, true);
+	subdir = dir.name;
+	while ((filename = r_readdir(&dir, options->include_hidden)) != NULL) {
+		if (dir.name != subdir) {
+			subdir = dir.name;
+			arl_watch_dir(&arl, subdir, root, true);
+		}
+		added |= insert_file(filename, root);
+		free(filename);
+	}
+	r_closedir(&dir);
+	return added;
+}
+
+/* removes file `name`, which vanished from below the watched argument `root`,
+ * or all files below it if it was a directory. the image being viewed is kept.
+ */
+bool drop_entries(const char *name, const char *root, bool isdir)
+{
+	size_t len = strlen(name);
+	bool dropped = false;
+	const struct root *r = find_root(root);
+	int i;
+
+	if (r == NULL || filecnt - removed == 1)
+		return false;
+	if (!isdir) {
+		if ((i = find_file(r, name)) < 0 || (mode == MODE_IMAGE && i == fileidx))
+			return false;
+		tombstone_file(i);
+		return true;
+	}
+	for (i = r->lo; i < r->hi && filecnt - removed > 1; i++) {
+		if ((files[i].flags & FF_REMOVED) || (mode == MODE_IMAGE && i == fileidx) ||
+		    strncmp(files[i].name, name, len) != 0 || files[i].name[len] != '/')
+		{
+			continue;
+		}
+		tombstone_file(i);
+		dropped = true;
+	}
+	return dropped;
+}
+
 void set_timeout(timeout_f handler, int time, bool overwrite)
 {
 	unsigned int i;
@@ -279,9 +763,67 @@ static bool check_timeouts(int *t)
 	return tmin != INT_MAX;
 }
 
+static int reload_delay(void)
+{
+	return MIN(MAX(2 * changes.gap, TO_AUTORELOAD), TO_AUTORELOAD_MAX);
+}
+
+/* samples the size and mtime of the image being viewed, returns true if they
+ * differ from the last sample.
+ */
+static bool sample_changes(void)
+{
+	struct stat st;
+	bool changed;
+	const char *path = file_realpath(&files[fileidx], false);
+
+	if (path == NULL || stat(path, &st) < 0)
+		st.st_size = -1;
+	changed = st.st_size != changes.size || (st.st_size != -1 &&
+	          (st.st_mtim.tv_sec != changes.mtime.tv_sec ||
+	           st.st_mtim.tv_nsec != changes.mtime.tv_nsec));
+	changes.size = st.st_size;
+	if (st.st_size != -1)
+		changes.mtime = st.st_mtim;
+	return changed;
+}
+
+/* schedules the reload of the image being viewed after it has been written
+ * to. the delay follows the time between the writes, so that a file which is
+ * written in bursts isn't decoded after each of them.
+ */
+static void image_changed(void)
+{
+	struct timeval now;
+	int gap;
+
+	gettimeofday(&now, 0);
+	if (img.autoreload_pending) {
+		gap = TV_DIFF(&now, &changes.last);
+		changes.gap = changes.gap == 0 ? gap : (changes.gap * 3 + gap) / 4;
+	}
+	changes.last = now;
+	(void)sample_changes();
+	img.autoreload_pending = true;
+	set_timeout(autoreload, reload_delay(), true);
+}
+
 static void autoreload(void)
 {
 	if (img.autoreload_pending) {
+		/* still growing without being closed, wait for another period */
+		if (sample_changes()) {
+			if (changes.size != -1)
+				set_timeout(autoreload, reload_delay(), true);
+			else
+				img.autoreload_pending = false;
+			return;
+		}
+		/* keep showing the old version if the new one can't be decoded yet */
+		if (!img_predecode(&files[fileidx])) {
+			img.autoreload_pending = false;
+			return;
+		}
 		img_close(&img, true);
 		/* load_image() sets autoreload_pending to false */
 		load_image(fileidx);
@@ -394,6 +936,7 @@ void load_image(int new)
 	if (new != current) {
 		alternate = current;
 		img.autoreload_pending = false;
+		changes.gap = 0;
 	}
 
 	img_close(&img, false);
@@ -404,6 +947,8 @@ void load_image(int new)
 		else if (new > 0 && prev)
 			new -= 1;
 	}
+	img_predecode(NULL);
+	dwell.pending = false;
 	files[new].flags &= ~FF_WARN;
 	fileidx = current = new;
 
@@ -442,6 +987,7 @@ static void bar_put(win_bar_t *bar, const char *fmt, ...)
 static void update_info(void)
 {
 	unsigned int i, fn, fw;
+	int next;
 	const char *mark;
 	win_bar_t *l = &win.bar.l, *r = &win.bar.r;
 	const char *filepath, *cmp_path;
@@ -483,9 +1029,10 @@ static void update_info(void)
 	if (mode == MODE_THUMB) {
 		if (tns.loadnext < tns.end)
 			bar_put(r, "Loading... %0*d | ", fw, tns.loadnext + 1);
-		else if (tns.initnext < filecnt)
-			bar_put(r, "Caching... %0*d | ", fw, tns.initnext + 1);
-		bar_put(r, "%s%0*d/%d", mark, fw, fileidx + 1, filecnt);
+		else if ((next = tns_next(&tns)) >= 0)
+			bar_put(r, "Caching... %0*d | ", fw, next + 1);
+		bar_put(r, "%s%0*d/%d%s", mark, fw, fileidx + 1, filecnt,
+		        input_pending() ? "+" : "");
 		if (info.ft.err)
 			strncpy(l->buf, files[fileidx].name, l->size);
 	} else {
@@ -508,7 +1055,7 @@ static void update_info(void)
 				;
 			bar_put(r, "%0*d/%d" BAR_SEP, fn, img.multi.sel + 1, img.multi.cnt);
 		}
-		bar_put(r, "%0*d/%d", fw, fileidx + 1, filecnt);
+		bar_put(r, "%0*d/%d%s", fw, fileidx + 1, filecnt, input_pending() ? "+" : "");
 		if (info.f.err)
 			strncpy(l->buf, files[fileidx].name, l->size);
 	}
@@ -535,7 +1082,9 @@ int nav_button(void)
 
 void redraw(void)
 {
-	int t;
+	int t, first, end;
+
+	compact_files();
 
 	if (mode == MODE_IMAGE) {
 		img_render(&img);
@@ -546,7 +1095,12 @@ void redraw(void)
 			set_timeout(slideshow, t, false);
 		}
 	} else {
+		/* without inotify, symlinks can't be known to be unchanged */
+		if (arl.fd == -1)
+			file_realpath_invalidate();
 		tns_render(&tns);
+		tns_range(&tns, &first, &end);
+		arl_watch_thumbs(&arl, first, end);
 	}
 	update_info();
 	win_draw(&win);
@@ -573,7 +1127,7 @@ void reset_cursor(void)
 			}
 		}
 	} else {
-		if (tns.loadnext < tns.end || tns.initnext < filecnt)
+		if (tns_next(&tns) >= 0)
 			cursor = CURSOR_WATCH;
 		else
 			cursor = CURSOR_ARROW;
@@ -600,6 +1154,18 @@ void clear_resize(void)
 	resized = false;
 }
 
+static void prefetch_thumbs(void)
+{
+	if (tns.thumbs == NULL)
+		tns_init(&tns, files, &filecnt, &fileidx, &win);
+	idle = true;
+}
+
+static void predecode(void)
+{
+	dwell.pending = mode == MODE_THUMB && dwell.sel == fileidx;
+}
+
 static Bool is_input_ev(Display *dpy, XEvent *ev, XPointer arg)
 {
 	return ev->type == ButtonPress || ev->type == KeyPress;
@@ -676,6 +1242,8 @@ static bool run_key_handler(const char *key, unsigned int mask)
 	fclose(pfs);
 	while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
 		;
+	/* the handler might have replaced symlinks */
+	file_realpath_invalidate();
 
 	for (f = i = 0; f < fcnt; i++) {
 		if ((marked && (files[i].flags & FF_MARK)) || (!marked && i == fileidx)) {
@@ -683,7 +1251,8 @@ static bool run_key_handler(const char *key, unsigned int mask)
 			if (filepath == NULL)
 				filepath = files[i].name;
 			if ((files[i].flags & FF_TN_NEEDS_UPDATE) || stat(filepath, &st) != 0 ||
-			    memcmp(&oldst[f].st_mtime, &st.st_mtime, sizeof(st.st_mtime)) != 0)
+			    oldst[f].st_mtim.tv_sec != st.st_mtim.tv_sec ||
+			    oldst[f].st_mtim.tv_nsec != st.st_mtim.tv_nsec)
 			{
 				if (tns.thumbs != NULL) {
 					tns_unload(&tns, i);
@@ -784,43 +1353,77 @@ static void on_buttonpress(const XButtonEvent *bev)
 
 static void run(void)
 {
-	enum { FD_X, FD_INFO, FD_TITLE, FD_ARL, FD_CNT };
+	enum { FD_X, FD_INFO, FD_TITLE, FD_ARL, FD_CACHE, FD_INPUT, FD_CNT };
 	struct pollfd pfd[FD_CNT];
 	int timeout = 0;
-	bool discard, init_thumb, load_thumb, to_set;
+	bool discard, to_set, gc, more, changed, cache_only = false;
+	int next_thumb;
 	XEvent ev, nextev;
 
 	xbutton_ev = &ev.xbutton;
+	set_timeout(prefetch_thumbs, TO_PREFETCH, false);
 	while (true) {
+		if (mode == MODE_THUMB && dwell.sel != fileidx) {
+			/* the selection moved, drop the image decoded for the old one */
+			dwell.sel = fileidx;
+			dwell.pending = false;
+			img_predecode(NULL);
+			set_timeout(predecode, TO_PREDECODE, true);
+		}
 		to_set = check_timeouts(&timeout);
-		init_thumb = mode == MODE_THUMB && tns.initnext < filecnt;
-		load_thumb = mode == MODE_THUMB && tns.loadnext < tns.end;
+		if (mode == MODE_THUMB)
+			next_thumb = tns_next(&tns);
+		else if (idle && !img.multi.animate)
+			next_thumb = tns_prefetch(&tns, &cache_only);
+		else
+			next_thumb = -1;
+		gc = next_thumb < 0 && tns_cache_gc_pending();
+		more = input_ready();
 
-		if ((init_thumb || load_thumb || to_set || info.fd != -1 || arl.fd != -1) &&
+		if ((more || next_thumb >= 0 || gc || dwell.pending || to_set || info.fd != -1 ||
+		     arl.fd != -1 || input.fd != -1 || tns_cache_writer_fd() != -1) &&
 		    XPending(win.env.dpy) == 0)
 		{
-			if (load_thumb) {
+			if (more) {
+				read_input();
+				if (mode == MODE_THUMB)
+					tns.dirty = true;
 				set_timeout(redraw, TO_REDRAW_THUMBS, false);
-				if (!tns_load(&tns, tns.loadnext, false, false)) {
-					remove_file(tns.loadnext, false);
+			} else if (dwell.pending && mode == MODE_THUMB && tns.loadnext >= tns.end) {
+				/* decode the selected image once its thumbnail is shown */
+				dwell.pending = false;
+				img_predecode(&files[fileidx]);
+			} else if (next_thumb >= 0 && mode == MODE_IMAGE) {
+				/* unloadable files are left to be removed by load_image() */
+				if (!tns_load(&tns, next_thumb, false, cache_only))
+					files[next_thumb].flags |= FF_TN_INIT;
+			} else if (next_thumb >= 0) {
+				bool visible = next_thumb >= tns.first && next_thumb < tns.end;
+
+				set_timeout(redraw, TO_REDRAW_THUMBS, false);
+				if (!tns_load(&tns, next_thumb, false, !visible)) {
+					/* the loading cursor skips it until the view is complete */
+					tombstone_file(next_thumb);
 					tns.dirty = true;
 				}
-				if (tns.loadnext >= tns.end) {
+				if (visible && tns.loadnext >= tns.end) {
+					compact_files();
 					open_info();
 					redraw();
 				}
-			} else if (init_thumb) {
-				set_timeout(redraw, TO_REDRAW_THUMBS, false);
-				if (!tns_load(&tns, tns.initnext, false, true))
-					remove_file(tns.initnext, false);
+			} else if (gc) {
+				tns_cache_gc();
 			} else {
 				pfd[FD_X].fd = ConnectionNumber(win.env.dpy);
 				pfd[FD_INFO].fd = info.fd;
 				pfd[FD_TITLE].fd = wintitle.fd;
 				pfd[FD_ARL].fd = arl.fd;
+				pfd[FD_CACHE].fd = tns_cache_writer_fd();
+				pfd[FD_INPUT].fd = input.fd;
 
-				pfd[FD_X].events = pfd[FD_ARL].events = POLLIN;
+				pfd[FD_X].events = pfd[FD_ARL].events = pfd[FD_INPUT].events = POLLIN;
 				pfd[FD_INFO].events = pfd[FD_TITLE].events = 0;
+				pfd[FD_CACHE].events = POLLOUT;
 
 				if (poll(pfd, ARRLEN(pfd), to_set ? timeout : -1) < 0)
 					continue;
@@ -828,14 +1431,23 @@ static void run(void)
 					read_info();
 				if (pfd[FD_TITLE].revents & POLLHUP)
 					read_title();
-				if ((pfd[FD_ARL].revents & POLLIN) && arl_handle(&arl)) {
-					img.autoreload_pending = true;
-					set_timeout(autoreload, TO_AUTORELOAD, true);
+				if (pfd[FD_ARL].revents & POLLIN) {
+					if (arl_handle(&arl, &changed))
+						image_changed();
+					if (changed) {
+						if (mode == MODE_THUMB)
+							tns.dirty = true;
+						set_timeout(redraw, TO_REDRAW_THUMBS, false);
+					}
 				}
+				if (pfd[FD_CACHE].revents & (POLLOUT | POLLERR))
+					tns_cache_flush(false);
 			}
 			continue;
 		}
 
+		/* the event handlers don't know about the removed files */
+		compact_files();
 		do {
 			XNextEvent(win.env.dpy, &ev);
 			discard = false;
@@ -854,6 +1466,10 @@ static void run(void)
 			}
 		} while (discard);
 
+		/* pause the thumbnail creation of image mode until input stops */
+		idle = false;
+		set_timeout(prefetch_thumbs, TO_PREFETCH, true);
+
 		switch (ev.type) {
 		case ButtonPress:
 			on_buttonpress(&ev.xbutton);
@@ -932,28 +1548,26 @@ int main(int argc, char *argv[])
 	}
 
 	if (options->recursive || options->from_stdin)
-		filecnt = 1024;
+		filecap = 1024;
 	else
-		filecnt = options->filecnt;
+		filecap = options->filecnt;
 
-	files = ecalloc(filecnt, sizeof(*files));
-	fileidx = 0;
-
-	if (options->from_stdin) {
-		char *filename = NULL;
-		n = 0;
-		while (xgetline(&filename, &n))
-			add_entry(filename);
-		free(filename);
-	}
+	files = ecalloc(filecap, sizeof(*files));
+	filecnt = fileidx = 0;
+	/* before the list is built, so that its directories can be watched */
+	arl_init(&arl);
 
-	for (i = 0; i < options->filecnt; i++)
-		add_entry(options->filenames[i]);
+	/* only add the entries up to the one to start with here, the window is
+	 * opened right away and the remaining ones are added from the main loop
+	 */
+	input.fd = options->from_stdin ? STDIN_FILENO : -1;
+	input.arg = 0;
+	while (filecnt <= options->startnum && input_pending())
+		read_input();
 
-	if (fileidx == 0)
+	if (filecnt == 0)
 		error(EXIT_FAILURE, 0, "No valid image file given, aborting");
 
-	filecnt = fileidx;
 	fileidx = options->startnum < filecnt ? options->startnum : 0;
 
 	if (options->update_cache) {
@@ -961,18 +1575,16 @@ int main(int argc, char *argv[])
 			error(0, 0, "private mode was enabled, not caching anything");
 			exit(EXIT_SUCCESS);
 		}
+		while (input_pending())
+			read_input();
 		tns_free(&tns);
 		tns_init(&tns, files, &filecnt, &fileidx, NULL);
-		while (filecnt > 0) {
-			tns_load(&tns, filecnt - 1, false, true);
-			remove_file(filecnt - 1, true);
-		}
-		assert(0 && "unreachable");
+		tns_update_cache(&tns, options->cache_jobs);
+		exit(EXIT_SUCCESS);
 	}
 
 	win_init(&win);
 	img_init(&img, &win);
-	arl_init(&arl);
 
 	if ((homedir = getenv("XDG_CONFIG_HOME")) == NULL || homedir[0] == '\0') {
 		homedir = getenv("HOME");
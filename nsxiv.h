@@ -26,6 +26,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include <Imlib2.h>
@@ -103,24 +104,30 @@ typedef enum {
 	FF_MARK    = 2,
 	FF_TN_INIT = 4,
 	FF_SYMLINK = 8,
-	FF_TN_NEEDS_UPDATE = 16
+	FF_TN_NEEDS_UPDATE = 16,
+	FF_REMOVED = 32 /* waiting for compact_files() */
 } fileflags_t;
 
 typedef struct {
 	const char *name; /* as given by user */
 	const char *path; /* lazily resolved absolute path, generally should be accessed via file_realpath() */
 	fileflags_t flags;
+	unsigned int pathgen; /* of file_realpath() when path was checked last */
 } fileinfo_t;
 
 const char *file_realpath(const fileinfo_t*, bool);
+void file_realpath_invalidate(void);
 
 /* timeouts in milliseconds: */
 enum {
-	TO_AUTORELOAD    = 128,
-	TO_REDRAW_RESIZE = 75,
-	TO_REDRAW_THUMBS = 200,
-	TO_CURSOR_HIDE   = 1200,
-	TO_DOUBLE_CLICK  = 300
+	TO_AUTORELOAD     = 128,
+	TO_AUTORELOAD_MAX = 3000,
+	TO_REDRAW_RESIZE  = 75,
+	TO_REDRAW_THUMBS  = 200,
+	TO_CURSOR_HIDE    = 1200,
+	TO_DOUBLE_CLICK   = 300,
+	TO_PREFETCH       = 500,
+	TO_PREDECODE      = 350
 };
 
 typedef void (*timeout_f)(void);
@@ -136,18 +143,33 @@ typedef struct win win_t;
 
 struct arl {
 	int fd;
+	/* the image being viewed, by its name in the watched directories */
 	int wd_dir;
-	int wd_file;
-	int wd_link;
 	int wd_link_dir;
 	char *filename;
 	char *linkname;
+
+	struct arl_dir *dirs; /* sorted by watch descriptor */
+	int dircnt;
+	int dircap;
+	struct arl_key *keys; /* hash table of the paths of the directories */
+	unsigned int keycap;
+	unsigned int keyused;
+
+	struct {
+		int first, end, cnt;
+		int *wd; /* of the directory of each file in the range */
+		unsigned int gen;
+		bool moved; /* files have been moved since the range was watched */
+	} thumbs;
 };
 
 void arl_init(arl_t*);
 void arl_cleanup(arl_t*);
 void arl_add(arl_t*, const fileinfo_t *);
-bool arl_handle(arl_t*);
+bool arl_handle(arl_t*, bool*);
+void arl_watch_dir(arl_t*, const char*, const char*, bool);
+void arl_watch_thumbs(arl_t*, int, int);
 
 
 /* commands.c */
@@ -220,6 +242,7 @@ struct img {
 
 void img_init(img_t*, win_t*);
 bool img_load(img_t*, const fileinfo_t*);
+bool img_predecode(const fileinfo_t*);
 CLEANUP void img_free(Imlib_Image, bool);
 CLEANUP void img_close(img_t*, bool);
 void img_render(img_t*);
@@ -238,6 +261,8 @@ bool img_change_color_modifier(img_t*, int, int*);
 bool img_frame_navigate(img_t*, int);
 bool img_frame_animate(img_t*);
 Imlib_Image img_open(const fileinfo_t*);
+bool img_sniff(const char*);
+Imlib_Image img_open_thumb(const fileinfo_t*, int);
 #if HAVE_LIBEXIF
 void exif_auto_orientate(const fileinfo_t*);
 #endif
@@ -256,6 +281,8 @@ struct opt {
 	int filecnt;
 	int startnum;
 	bool assume_files;
+	bool natural_sort;
+	bool watch;
 
 	/* image: */
 	scalemode_t scalemode;
@@ -281,6 +308,7 @@ struct opt {
 	bool thumb_mode;
 	bool clean_cache;
 	bool update_cache;
+	int cache_jobs;
 	bool private_mode;
 };
 
@@ -294,10 +322,13 @@ void parse_options(int, char**);
 
 typedef struct {
 	Imlib_Image im;
+	uint16_t *px; /* RGB565 pixels of a compacted thumbnail, im is NULL then */
 	int w;
 	int h;
 	int x;
 	int y;
+	int slot; /* index into the atlas + 1, 0 if not uploaded */
+	unsigned int used; /* tns.tick of the last render it was visible in */
 } thumb_t;
 
 typedef struct {
@@ -308,13 +339,21 @@ typedef struct {
 
 struct tns {
 	fileinfo_t *files;
-	thumb_t *thumbs;
+	struct tns_page **thumbs; /* sparse, only pages with loaded thumbnails */
+	int pagecnt;
 	const int *cnt;
 	int *sel;
-	int initnext;
 	int loadnext;
 	int first, end;
 	int r_first, r_end;
+	direction_t scrolldir;
+	int loaded;
+	unsigned int tick;
+
+	struct {
+		int sel;
+		int lo, hi;
+	} init;
 
 	win_t *win;
 	int x;
@@ -328,15 +367,37 @@ struct tns {
 	thumb_filter_t *filters;
 	int filters_cnt;
 
+	struct {
+		Pixmap pm;
+		GC gc;
+		int cols;
+		int rows;
+		int next;
+		int *free;
+		int freecnt;
+	} atlas;
+
 	bool dirty;
 	bool filters_is_blacklist;
 };
 
 void tns_clean_cache(void);
+bool tns_cache_gc_pending(void);
+void tns_cache_gc(void);
+void tns_cache_flush(bool);
+int tns_cache_writer_fd(void);
+void tns_update_cache(tns_t*, int);
 void tns_init(tns_t*, fileinfo_t*, const int*, int*, win_t*);
 CLEANUP void tns_free(tns_t*);
 bool tns_load(tns_t*, int, bool, bool);
 void tns_unload(tns_t*, int);
+void tns_remove(tns_t*, int);
+void tns_insert(tns_t*, int);
+void tns_range(const tns_t*, int*, int*);
+void tns_remove_flagged(tns_t*);
+int tns_next(tns_t*);
+int tns_prefetch(tns_t*, bool*);
+void tns_atlas_reset(tns_t*);
 void tns_render(tns_t*);
 void tns_mark(tns_t*, int, bool);
 void tns_highlight(tns_t*, int, bool);
@@ -353,6 +414,7 @@ int tns_translate(tns_t*, int, int);
 typedef struct {
 	DIR *dir;
 	char *name;
+	size_t len;
 	int d;
 	bool recursive;
 
@@ -368,6 +430,9 @@ void* ecalloc(size_t, size_t);
 void* erealloc(void*, size_t);
 char* estrdup(const char*);
 char* estrndup(const char*, size_t);
+char* arena_strndup(const char*, size_t);
+void arena_free(const char*);
+void arena_compact(fileinfo_t*, int);
 void error(int, int, const char*, ...);
 int r_opendir(r_dir_t*, const char*, bool);
 int r_closedir(r_dir_t*);
@@ -456,6 +521,7 @@ void win_toggle_bar(win_t*);
 void win_clear(win_t*);
 void win_draw(win_t*);
 void win_draw_rect(win_t*, int, int, int, int, bool, int, unsigned long);
+void win_copy_area(win_t*, int, int, int, int, int, int);
 void win_set_title(win_t*, const char*, size_t);
 void win_set_cursor(win_t*, cursor_t);
 void win_cursor_pos(win_t*, int*, int*);
@@ -470,6 +536,9 @@ void slideshow(void);
 void clear_resize(void);
 
 void remove_file(int, bool);
+void compact_files(void);
+bool insert_entry(const char*, const char*);
+bool drop_entries(const char*, const char*, bool);
 void set_timeout(timeout_f, int, bool);
 void reset_timeout(timeout_f);
 void close_info(void);
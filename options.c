@@ -60,6 +60,9 @@ static void print_version(void)
 #endif
 #if HAVE_LIBEXIF
 		"+exif "
+#endif
+#if HAVE_LIBJPEG
+		"+jpeg "
 #endif
 		"+multiframe "
 		"\n", stdout);
@@ -88,7 +91,9 @@ void parse_options(int argc, char **argv)
 		OPT_CD,
 		OPT_UC,
 		OPT_HIDDEN,
-		OPT_AF
+		OPT_AF,
+		OPT_NS,
+		OPT_WATCH
 	};
 	static const struct optparse_long longopts[] = {
 		{ "framerate",      'A',     OPTPARSE_REQUIRED },
@@ -107,6 +112,7 @@ void parse_options(int argc, char **argv)
 		{ "help",           'h',     OPTPARSE_NONE },
 		{ "stdin",          'i',     OPTPARSE_NONE },
 		{ "name",           'N',     OPTPARSE_REQUIRED },
+		{ "natural-sort",  OPT_NS,   OPTPARSE_OPTIONAL },
 		{ "class",       OPT_CLASS,  OPTPARSE_REQUIRED },
 		{ "start-at",       'n',     OPTPARSE_REQUIRED },
 		{ "stdout",         'o',     OPTPARSE_NONE },
@@ -119,6 +125,7 @@ void parse_options(int argc, char **argv)
 		{ NULL,             't',     OPTPARSE_NONE },
 		{ "thumbnail",   OPT_THUMB,  OPTPARSE_OPTIONAL },
 		{ "version",        'v',     OPTPARSE_NONE },
+		{ "watch",       OPT_WATCH,  OPTPARSE_OPTIONAL },
 		{ "zoom-100",       'Z',     OPTPARSE_NONE },
 		{ "zoom",           'z',     OPTPARSE_REQUIRED },
 		{ "null",           '0',     OPTPARSE_NONE },
@@ -126,7 +133,7 @@ void parse_options(int argc, char **argv)
 		{ "alpha-layer",   OPT_AL,   OPTPARSE_OPTIONAL },
 		{ "cache-allow",   OPT_CA,   OPTPARSE_REQUIRED },
 		{ "cache-deny",    OPT_CD,   OPTPARSE_REQUIRED },
-		{ "update-cache",  OPT_UC,   OPTPARSE_NONE },
+		{ "update-cache",  OPT_UC,   OPTPARSE_OPTIONAL },
 		{ 0 }, /* end */
 	};
 
@@ -145,6 +152,8 @@ void parse_options(int argc, char **argv)
 	_options.include_hidden = false;
 	_options.startnum = 0;
 	_options.assume_files = false;
+	_options.natural_sort = NATURAL_SORT;
+	_options.watch = WATCH_DIRS;
 
 	_options.scalemode = SCALE_DOWN;
 	_options.zoom = 1.0;
@@ -167,6 +176,7 @@ void parse_options(int argc, char **argv)
 	_options.thumb_mode = false;
 	_options.clean_cache = false;
 	_options.update_cache = false;
+	_options.cache_jobs = 0;
 	_options.private_mode = false;
 
 	if (argc > 0) {
@@ -293,6 +303,12 @@ void parse_options(int argc, char **argv)
 		case OPT_AL:
 			_options.alpha_layer = parse_optional_no("alpha-layer", op.optarg);
 			break;
+		case OPT_NS:
+			_options.natural_sort = parse_optional_no("natural-sort", op.optarg);
+			break;
+		case OPT_WATCH:
+			_options.watch = parse_optional_no("watch", op.optarg);
+			break;
 		case OPT_THUMB:
 			_options.thumb_mode = parse_optional_no("thumbnail", op.optarg);
 			break;
@@ -302,6 +318,12 @@ void parse_options(int argc, char **argv)
 			break;
 		case OPT_UC:
 			_options.update_cache = true;
+			if (op.optarg != NULL) {
+				n = strtol(op.optarg, &end, 0);
+				if (*end != '\0' || n <= 0 || n > INT_MAX)
+					error(EXIT_FAILURE, 0, "Invalid number of jobs: %s", op.optarg);
+				_options.cache_jobs = n;
+			}
 			break;
 		}
 	}
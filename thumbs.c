@@ -23,20 +23,152 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
-#include <utime.h>
 
 #if HAVE_LIBEXIF
 #include <libexif/exif-data.h>
 #endif
 
+enum { ATLAS_WIDTH = 4096 };
+enum { GC_BATCH = 256, GC_INTERVAL = 1024 };
+enum { WRITE_QUEUE = 32 };
+enum { TNS_PAGE = 256 };
+
+struct tns_page {
+	int loaded;
+	thumb_t t[TNS_PAGE];
+};
+
+typedef struct {
+	char *path;
+	size_t len;
+	int fd;
+	int flags; /* of fstatat(2) */
+	bool failed; /* the directory can't be opened */
+} dirfd_t;
+
 static char *cache_dir;
 static char *cache_tmpfile, *cache_tmpfile_base;
 static const char TMP_NAME[] = "/nsxiv-XXXXXX";
+static const char CONTENT_DIR[] = "/.content";
+static const char INDEX_NAME[] = "/.index";
+static int index_fd = -1;
+static bool load_hit; /* the last thumbnail was loaded from the cache */
+static bool index_failed; /* stop appending after a write error */
+
+/* header of a thumbnail sent to the writer process, followed by the path of
+ * the original file and the pixel data.
+ */
+typedef struct {
+	struct stat fstats;
+	int w, h;
+	bool alpha;
+	size_t pathlen;
+} cache_job_t;
+
+typedef struct {
+	char *buf;
+	size_t len, off;
+} cache_msg_t;
+
+static struct {
+	int fd;
+	bool sync; /* no writer process, save in place */
+	cache_msg_t q[WRITE_QUEUE];
+	int head, cnt;
+} writer = { -1, false };
+
+typedef struct {
+	char *path; /* relative to cache_dir */
+	off_t size;
+	time_t atime;
+	bool link; /* path entry of a content addressed file */
+} cache_entry_t;
+
+/* state of the incremental cache garbage collection */
+static struct {
+	enum { GC_IDLE, GC_READ, GC_STAT } state;
+	bool ran;
+	int writes;
+	int dirfd;
+	FILE *fp;
+	cache_entry_t *ent;
+	size_t cnt, cap, pos;
+	off_t off; /* size of the index when it was read, -1 if not read */
+} gc = { GC_IDLE, false, 0, -1, NULL, NULL, 0, 0, 0, -1 };
+
+/* most consecutive thumbnails share their source and cache directory. the
+ * mtime of a path entry in the cache is the one of the symlink itself.
+ */
+static dirfd_t src_dirfd = { NULL, 0, -1, 0 };
+static dirfd_t cache_dirfd = { NULL, 0, -1, AT_SYMLINK_NOFOLLOW };
+
+static void tns_dirfd_close(dirfd_t *d)
+{
+	if (d->fd != -1)
+		close(d->fd);
+	free(d->path);
+	d->path = NULL;
+	d->fd = -1;
+	d->failed = false;
+}
+
+/* the directory is only opened for the second file in it in a row, so that
+ * scattered files cost no more than a plain stat(2) each.
+ */
+static int tns_stat(dirfd_t *d, const char *filepath, struct stat *st)
+{
+	const char *base = strrchr(filepath, '/');
+	size_t len = base - filepath;
+
+	assert(base != NULL);
+	if (d->path == NULL || d->len != len || memcmp(d->path, filepath, len) != 0) {
+		tns_dirfd_close(d);
+		d->path = estrndup(filepath, MAX(len, 1)); /* account for "/file" */
+		d->len = len;
+		return fstatat(AT_FDCWD, filepath, st, d->flags);
+	}
+	if (d->fd == -1 && !d->failed &&
+	    (d->fd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+	{
+		d->failed = true;
+	}
+	if (d->fd == -1)
+		return fstatat(AT_FDCWD, filepath, st, d->flags);
+	return fstatat(d->fd, base + 1, st, d->flags);
+}
+
+/* the cache might live on a filesystem with coarser timestamps than the
+ * source, so also accept its mtime truncated to microseconds. a cache file
+ * without nanoseconds, such as one of an older version, can't tell rewrites
+ * within the same second apart and is regenerated.
+ */
+static bool tns_cache_fresh(const struct stat *fstats, const struct stat *cstats)
+{
+	long ns = fstats->st_mtim.tv_nsec;
+
+	return cstats->st_mtim.tv_sec == fstats->st_mtim.tv_sec &&
+	       (cstats->st_mtim.tv_nsec == ns || cstats->st_mtim.tv_nsec == ns - ns % 1000);
+}
+
+static char *tns_cache_subpath(const char *name)
+{
+	size_t len = strlen(cache_dir) + strlen(name) + 1;
+	char *path = emalloc(len);
+
+	snprintf(path, len, "%s%s", cache_dir, name);
+	return path;
+}
 
 static char *tns_cache_filepath(const char *filepath)
 {
@@ -54,25 +186,142 @@ static char *tns_cache_filepath(const char *filepath)
 	return cfile;
 }
 
-static Imlib_Image tns_cache_load(const char *filepath, bool *outdated)
+/* content addressed cache files are keyed by a hash of the size, head and
+ * tail of the source. the path based cache file is a symlink to it, which
+ * serves as the path to hash index and carries the mtime of its own source.
+ */
+static char *tns_cache_content_filepath(const char *filepath, const struct stat *fstats)
 {
+	enum { SAMPLE_SIZE = 16 * 1024 };
+	unsigned char buf[SAMPLE_SIZE];
+	uint64_t hash = 0xcbf29ce484222325; /* FNV-1a */
+	off_t off[2] = { 0, SAMPLE_SIZE };
+	ssize_t i, n = 0;
+	int fd, s;
+	size_t len;
 	char *cfile;
-	struct stat cstats, fstats;
-	Imlib_Image im = NULL;
 
-	if (stat(filepath, &fstats) < 0)
+	if ((fd = open(filepath, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+	if (fstats->st_size > 2 * SAMPLE_SIZE)
+		off[1] = fstats->st_size - SAMPLE_SIZE;
+	for (i = 0; i < (ssize_t)sizeof(fstats->st_size); i++)
+		hash = (hash ^ ((uint64_t)fstats->st_size >> (i * 8) & 0xFF)) * 0x100000001b3;
+	for (s = 0; s < (int)ARRLEN(off) && off[s] < fstats->st_size; s++) {
+		if ((n = pread(fd, buf, sizeof(buf), off[s])) < 0)
+			break;
+		for (i = 0; i < n; i++)
+			hash = (hash ^ buf[i]) * 0x100000001b3;
+	}
+	close(fd);
+	if (n < 0)
 		return NULL;
 
-	if ((cfile = tns_cache_filepath(filepath)) != NULL) {
-		if (stat(cfile, &cstats) == 0) {
-			if (cstats.st_mtime == fstats.st_mtime)
-				im = imlib_load_image(cfile);
-			else
-				*outdated = true;
+	len = strlen(cache_dir) + sizeof(CONTENT_DIR) + 18;
+	cfile = emalloc(len);
+	snprintf(cfile, len, "%s%s/%02x/%06lx%08lx", cache_dir, CONTENT_DIR,
+	         (unsigned int)(hash >> 56), (unsigned long)(hash >> 32 & 0xFFFFFF),
+	         (unsigned long)(hash & 0xFFFFFFFF));
+	return cfile;
+}
+
+/* consecutive thumbnails are usually in the same directory, so remember the
+ * last one created. NULL forgets it.
+ */
+static int tns_cache_mkdir(char *cfile)
+{
+	static char *made;
+	int ret = 0;
+	char *dirend;
+
+	if (cfile == NULL || (dirend = strrchr(cfile, '/')) == NULL) {
+		free(made);
+		made = NULL;
+		return 0;
+	}
+	*dirend = '\0';
+	if (made == NULL || !STREQ(made, cfile)) {
+		free(made);
+		made = NULL;
+		if ((ret = r_mkdir(cfile)) == 0)
+			made = estrdup(cfile);
+	}
+	*dirend = '/';
+	return ret;
+}
+
+static void tns_cache_link(const char *ccfile, char *cfile, const struct stat *fstats)
+{
+	struct timespec times[2] = { { 0, UTIME_NOW } };
+
+	times[1] = fstats->st_mtim;
+	if (tns_cache_mkdir(cfile) == 0) {
+		unlink(cfile);
+		if (symlink(ccfile, cfile) == 0)
+			utimensat(AT_FDCWD, cfile, times, AT_SYMLINK_NOFOLLOW);
+	}
+}
+
+static bool tns_cache_bounded(void)
+{
+	return THUMB_CACHE_SIZE > 0 || THUMB_CACHE_FILES > 0;
+}
+
+/* the index is a list of '\0' terminated cache files relative to cache_dir,
+ * which is only appended to and compacted by the garbage collection. it is
+ * locked while appending, and the writer process notices the replacement by
+ * the link count of its index once the garbage collection has released it.
+ */
+static void tns_cache_index_add(const char *cfile)
+{
+	char *index;
+	const char *rel = cfile + strlen(cache_dir);
+	size_t len = strlen(rel) + 1;
+	struct stat st;
+
+	if (!tns_cache_bounded() || index_failed)
+		return;
+	while (true) {
+		if (index_fd < 0) {
+			index = tns_cache_subpath(INDEX_NAME);
+			index_fd = open(index, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+			free(index);
+			if (index_fd < 0)
+				return;
 		}
-		free(cfile);
+		if (flock(index_fd, LOCK_EX) < 0 || fstat(index_fd, &st) < 0 || st.st_nlink > 0)
+			break;
+		close(index_fd);
+		index_fd = -1;
+	}
+	if (write(index_fd, rel, len) != (ssize_t)len) {
+		/* a truncated entry is dropped by the garbage collection */
+		close(index_fd);
+		index_fd = -1;
+		index_failed = true;
+	} else {
+		flock(index_fd, LOCK_UN);
 	}
-	return im;
+}
+
+/* keep the atime of cache files, which the LRU eviction is based on, up to
+ * date regardless of the mount options, but at most once per hour. for the
+ * symlink of a content addressed file, it is the atime of the latter.
+ */
+static void tns_cache_touch(const char *cfile, const struct stat *cstats)
+{
+	struct timespec times[2] = { { 0, UTIME_NOW }, { 0, UTIME_OMIT } };
+	struct stat st;
+
+	if (!tns_cache_bounded() || options->private_mode)
+		return;
+	if (S_ISLNK(cstats->st_mode)) {
+		if (stat(cfile, &st) < 0)
+			return;
+		cstats = &st;
+	}
+	if (cstats->st_atim.tv_sec + 3600 < time(NULL))
+		utimensat(AT_FDCWD, cfile, times, 0);
 }
 
 static bool tns_cache_whitelisted(tns_t *tns, const char *filepath)
@@ -94,58 +343,483 @@ static bool tns_cache_whitelisted(tns_t *tns, const char *filepath)
 	return tns->filters_is_blacklist; /* no match */
 }
 
-static void tns_cache_write(tns_t *tns, Imlib_Image im, const char *filepath, bool force)
+static Imlib_Image tns_cache_load(tns_t *tns, const char *filepath,
+                                  const struct stat *fstats, bool *outdated)
 {
-	char *cfile, *dirend;
+	char *cfile, *ccfile;
+	struct stat cstats;
+	Imlib_Image im = NULL;
+
+	if (fstats == NULL)
+		return NULL;
+
+	if ((cfile = tns_cache_filepath(filepath)) != NULL) {
+		if (tns_stat(&cache_dirfd, cfile, &cstats) == 0) {
+			if (tns_cache_fresh(fstats, &cstats)) {
+				if ((im = imlib_load_image(cfile)) != NULL)
+					tns_cache_touch(cfile, &cstats);
+			} else
+				*outdated = true;
+		}
+		if (im == NULL && THUMB_CACHE_CONTENT &&
+		    (ccfile = tns_cache_content_filepath(filepath, fstats)) != NULL)
+		{
+			/* renamed, moved or duplicated file */
+			if ((im = imlib_load_image(ccfile)) != NULL) {
+				*outdated = false;
+				if (!options->private_mode && tns_cache_whitelisted(tns, filepath)) {
+					tns_cache_link(ccfile, cfile, fstats);
+					tns_cache_index_add(cfile);
+				}
+			}
+			free(ccfile);
+		}
+		free(cfile);
+	}
+	return im;
+}
+
+static void tns_cache_save(Imlib_Image im, const char *filepath, const struct stat *fstats)
+{
+	char *cfile, *ccfile = NULL;
 	int tmpfd;
-	struct stat cstats, fstats;
-	struct utimbuf times;
+	struct timespec times[2];
 	Imlib_Load_Error err;
 
-	if (options->private_mode || !tns_cache_whitelisted(tns, filepath))
+	if ((cfile = tns_cache_filepath(filepath)) == NULL)
 		return;
+	if (THUMB_CACHE_CONTENT)
+		ccfile = tns_cache_content_filepath(filepath, fstats);
+	if (tns_cache_mkdir(ccfile != NULL ? ccfile : cfile) < 0)
+		goto end;
+	imlib_context_set_image(im);
+	if (imlib_image_has_alpha()) {
+		imlib_image_set_format("png");
+		imlib_image_attach_data_value("compression", NULL, 8, NULL);
+	} else {
+		imlib_image_set_format("jpg");
+		imlib_image_attach_data_value("quality", NULL, 90, NULL);
+	}
+	memcpy(cache_tmpfile_base, TMP_NAME, sizeof(TMP_NAME));
+	if ((tmpfd = mkstemp(cache_tmpfile)) < 0)
+		goto end;
+	imlib_save_image_fd(tmpfd, ""); /* NOTE: closes `tmpfd` */
+	err = imlib_get_error();
+	times[0].tv_sec = 0;
+	times[0].tv_nsec = UTIME_NOW;
+	times[1] = fstats->st_mtim;
+	utimensat(AT_FDCWD, cache_tmpfile, times, 0);
+	if (err || rename(cache_tmpfile, ccfile != NULL ? ccfile : cfile) < 0) {
+		unlink(cache_tmpfile);
+		tns_cache_mkdir(NULL); /* the directory might have been removed */
+	} else {
+		if (ccfile != NULL) {
+			tns_cache_link(ccfile, cfile, fstats);
+			tns_cache_index_add(ccfile);
+		}
+		tns_cache_index_add(cfile);
+	}
+end:
+	free(ccfile);
+	free(cfile);
+}
+
+static bool tns_read_full(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, buf, len)) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return false;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+	}
+	return true;
+}
 
-	if (stat(filepath, &fstats) < 0)
+/* the writer process encodes and saves the thumbnails it receives from the
+ * pipe `fd` until it is closed.
+ */
+static void tns_writer_run(int fd)
+{
+	cache_job_t job;
+	char *path = NULL;
+	DATA32 *data = NULL;
+	Imlib_Image im;
+
+	while (tns_read_full(fd, &job, sizeof(job))) {
+		path = erealloc(path, job.pathlen);
+		data = erealloc(data, (size_t)job.w * job.h * sizeof(*data));
+		if (!tns_read_full(fd, path, job.pathlen) ||
+		    !tns_read_full(fd, data, (size_t)job.w * job.h * sizeof(*data)))
+		{
+			break;
+		}
+		if ((im = imlib_create_image_using_copied_data(job.w, job.h, data)) != NULL) {
+			imlib_context_set_image(im);
+			imlib_image_set_has_alpha(job.alpha);
+			tns_cache_save(im, path, &job.fstats);
+			imlib_context_set_image(im);
+			imlib_free_image();
+		}
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+static void tns_writer_close(void)
+{
+	while (writer.cnt > 0) {
+		free(writer.q[writer.head].buf);
+		writer.head = (writer.head + 1) % WRITE_QUEUE;
+		writer.cnt--;
+	}
+	if (writer.fd >= 0) {
+		close(writer.fd);
+		writer.fd = -1;
+	}
+}
+
+static void tns_writer_start(void)
+{
+	int pfd[2];
+
+	if (pipe(pfd) < 0) {
+		writer.sync = true;
 		return;
+	}
+	switch (fork()) {
+	case -1:
+		close(pfd[0]);
+		close(pfd[1]);
+		writer.sync = true;
+		break;
+	case 0:
+		close(pfd[1]);
+		tns_writer_run(pfd[0]);
+		break;
+	default:
+		close(pfd[0]);
+		writer.fd = pfd[1];
+		fcntl(writer.fd, F_SETFD, FD_CLOEXEC);
+		fcntl(writer.fd, F_SETFL, O_NONBLOCK);
+		break;
+	}
+}
 
-	if ((cfile = tns_cache_filepath(filepath)) != NULL) {
-		if (force || stat(cfile, &cstats) < 0 ||
-		    cstats.st_mtime != fstats.st_mtime)
+/* sends the oldest queued thumbnail to the writer process, returns true if
+ * it has been sent completely.
+ */
+static bool tns_writer_send(bool block)
+{
+	struct pollfd pfd;
+	ssize_t n;
+	cache_msg_t *e = &writer.q[writer.head];
+
+	pfd.fd = writer.fd;
+	pfd.events = POLLOUT;
+	while (e->off < e->len) {
+		if ((n = write(writer.fd, e->buf + e->off, e->len - e->off)) < 0) {
+			if (errno == EAGAIN && block) {
+				poll(&pfd, 1, -1);
+				continue;
+			} else if (errno == EAGAIN || errno == EINTR) {
+				return false;
+			}
+			/* the writer is gone, save synchronously from now on */
+			tns_writer_close();
+			writer.sync = true;
+			return false;
+		}
+		e->off += n;
+	}
+	free(e->buf);
+	writer.head = (writer.head + 1) % WRITE_QUEUE;
+	writer.cnt--;
+	return true;
+}
+
+void tns_cache_flush(bool block)
+{
+	while (writer.cnt > 0 && tns_writer_send(block))
+		;
+}
+
+int tns_cache_writer_fd(void)
+{
+	return writer.cnt > 0 ? writer.fd : -1;
+}
+
+static void tns_cache_write(tns_t *tns, Imlib_Image im, const char *filepath,
+                            const struct stat *fstats, bool force)
+{
+	char *cfile;
+	struct stat cstats;
+	cache_job_t job;
+	size_t datalen;
+	cache_msg_t *e;
+
+	if (options->private_mode || fstats == NULL || !tns_cache_whitelisted(tns, filepath))
+		return;
+
+	if ((cfile = tns_cache_filepath(filepath)) == NULL)
+		return;
+	if (!force && tns_stat(&cache_dirfd, cfile, &cstats) == 0 &&
+	    tns_cache_fresh(fstats, &cstats))
+	{
+		free(cfile);
+		return;
+	}
+	free(cfile);
+	gc.writes++;
+
+	if (writer.fd < 0 && !writer.sync)
+		tns_writer_start();
+	if (writer.sync) {
+		tns_cache_save(im, filepath, fstats);
+		return;
+	}
+
+	/* hand a copy of the thumbnail to the writer process */
+	imlib_context_set_image(im);
+	job.fstats = *fstats;
+	job.w = imlib_image_get_width();
+	job.h = imlib_image_get_height();
+	job.alpha = imlib_image_has_alpha();
+	job.pathlen = strlen(filepath) + 1;
+	datalen = (size_t)job.w * job.h * sizeof(DATA32);
+
+	if (writer.cnt == WRITE_QUEUE)
+		tns_writer_send(true);
+	if (writer.sync) {
+		tns_cache_save(im, filepath, fstats);
+		return;
+	}
+	e = &writer.q[(writer.head + writer.cnt++) % WRITE_QUEUE];
+	e->len = sizeof(job) + job.pathlen + datalen;
+	e->off = 0;
+	e->buf = emalloc(e->len);
+	memcpy(e->buf, &job, sizeof(job));
+	memcpy(e->buf + sizeof(job), filepath, job.pathlen);
+	memcpy(e->buf + sizeof(job) + job.pathlen,
+	       imlib_image_get_data_for_reading_only(), datalen);
+	tns_cache_flush(false);
+}
+
+static void tns_gc_push(const char *path, const struct stat *st)
+{
+	if (gc.cnt == gc.cap) {
+		gc.cap = gc.cap > 0 ? gc.cap * 2 : 1024;
+		gc.ent = erealloc(gc.ent, gc.cap * sizeof(*gc.ent));
+	}
+	gc.ent[gc.cnt].path = estrdup(path);
+	gc.ent[gc.cnt].link = st != NULL && S_ISLNK(st->st_mode);
+	gc.ent[gc.cnt].size = st != NULL && !gc.ent[gc.cnt].link ? st->st_size : 0;
+	gc.ent[gc.cnt].atime = st != NULL ? st->st_atim.tv_sec : 0;
+	gc.cnt++;
+}
+
+static int tns_gc_cmp_path(const void *a, const void *b)
+{
+	return strcmp(((const cache_entry_t *)a)->path, ((const cache_entry_t *)b)->path);
+}
+
+static int tns_gc_cmp_atime(const void *a, const void *b)
+{
+	time_t ta = ((const cache_entry_t *)a)->atime, tb = ((const cache_entry_t *)b)->atime;
+
+	return (ta > tb) - (ta < tb);
+}
+
+static bool tns_gc_over(off_t size, size_t cnt)
+{
+	return (THUMB_CACHE_SIZE > 0 && size > (off_t)THUMB_CACHE_SIZE * 1024 * 1024) ||
+	       (THUMB_CACHE_FILES > 0 && cnt > (size_t)THUMB_CACHE_FILES);
+}
+
+static void tns_gc_reset(void)
+{
+	size_t i;
+
+	for (i = 0; i < gc.cnt; i++)
+		free(gc.ent[i].path);
+	free(gc.ent);
+	gc.ent = NULL;
+	gc.cnt = gc.cap = gc.pos = 0;
+	gc.off = -1;
+	if (gc.fp != NULL) {
+		fclose(gc.fp);
+		gc.fp = NULL;
+	}
+	if (gc.dirfd >= 0) {
+		close(gc.dirfd);
+		gc.dirfd = -1;
+	}
+	gc.state = GC_IDLE;
+}
+
+/* removes the least recently used entries of `gc.ent`, which must have been
+ * stat'ed, until the cache is within its limits and replaces the index with
+ * the remaining ones. the symlinks of content addressed files don't count,
+ * only the files they point to, and dangling ones are removed by the next run.
+ */
+static void tns_gc_evict(void)
+{
+	size_t i, j, cnt = 0;
+	off_t size = 0, off = gc.off;
+	char *index, buf[BUFSIZ];
+	ssize_t n;
+	int fd, old;
+
+	qsort(gc.ent, gc.cnt, sizeof(*gc.ent), tns_gc_cmp_path);
+	for (i = j = 0; i < gc.cnt; i++) {
+		if (gc.ent[i].path == NULL || (j > 0 && STREQ(gc.ent[i].path, gc.ent[j - 1].path))) {
+			free(gc.ent[i].path);
+		} else {
+			size += gc.ent[i].size;
+			cnt += !gc.ent[i].link;
+			gc.ent[j++] = gc.ent[i];
+		}
+	}
+	gc.cnt = j;
+
+	qsort(gc.ent, gc.cnt, sizeof(*gc.ent), tns_gc_cmp_atime);
+	for (i = 0; i < gc.cnt && tns_gc_over(size, cnt); i++) {
+		if (gc.ent[i].link)
+			continue;
+		if (unlinkat(gc.dirfd, gc.ent[i].path + 1, 0) < 0 && errno != ENOENT)
+			break;
+		size -= gc.ent[i].size;
+		cnt--;
+		free(gc.ent[i].path);
+		gc.ent[i].path = NULL;
+	}
+
+	memcpy(cache_tmpfile_base, TMP_NAME, sizeof(TMP_NAME));
+	if ((fd = mkstemp(cache_tmpfile)) < 0)
+		return;
+	for (j = 0; j < gc.cnt; j++) {
+		if (gc.ent[j].path != NULL &&
+		    write(fd, gc.ent[j].path, strlen(gc.ent[j].path) + 1) < 0)
 		{
-			if ((dirend = strrchr(cfile, '/')) != NULL) {
-				*dirend = '\0';
-				if (r_mkdir(cfile) < 0)
-					goto end;
-				*dirend = '/';
+			break;
+		}
+	}
+	index = tns_cache_subpath(INDEX_NAME);
+	old = off >= 0 ? open(index, O_RDONLY | O_CLOEXEC) : -1;
+	/* appending waits until the tail has been copied to the new index */
+	if (old >= 0)
+		flock(old, LOCK_EX);
+	flock(fd, LOCK_EX);
+	if (j < gc.cnt || rename(cache_tmpfile, index) < 0) {
+		unlink(cache_tmpfile);
+	} else if (old >= 0) {
+		/* keep the entries appended since the old index has been read */
+		fcntl(fd, F_SETFL, O_APPEND);
+		while ((n = pread(old, buf, sizeof(buf), off)) > 0 && write(fd, buf, n) == n)
+			off += n;
+	}
+	if (old >= 0)
+		close(old);
+	close(fd);
+	free(index);
+}
+
+bool tns_cache_gc_pending(void)
+{
+	if (gc.state != GC_IDLE)
+		return true;
+	return cache_dir != NULL && gc.writes > 0 && (!gc.ran || gc.writes >= GC_INTERVAL);
+}
+
+/* performs one step of the garbage collection of a size bounded cache: the
+ * index is read, the entries are stat'ed for their size and atime and then
+ * evicted, each in batches to not block the main loop.
+ */
+void tns_cache_gc(void)
+{
+	char *index, *line = NULL;
+	size_t i, n = 0;
+	struct stat st;
+
+	switch (gc.state) {
+	case GC_IDLE:
+		gc.writes = 0;
+		gc.ran = true;
+		index = tns_cache_subpath(INDEX_NAME);
+		gc.fp = fopen(index, "r");
+		free(index);
+		gc.dirfd = open(cache_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (gc.fp == NULL || gc.dirfd < 0)
+			tns_gc_reset();
+		else
+			gc.state = GC_READ;
+		break;
+	case GC_READ:
+		for (i = 0; i < GC_BATCH; i++) {
+			if (getdelim(&line, &n, '\0', gc.fp) <= 0) {
+				gc.off = ftello(gc.fp);
+				fclose(gc.fp);
+				gc.fp = NULL;
+				gc.state = GC_STAT;
+				break;
 			}
-			imlib_context_set_image(im);
-			if (imlib_image_has_alpha()) {
-				imlib_image_set_format("png");
-				imlib_image_attach_data_value("compression", NULL, 8, NULL);
+			if (line[0] == '/')
+				tns_gc_push(line, NULL);
+		}
+		free(line);
+		break;
+	case GC_STAT:
+		for (i = 0; i < GC_BATCH && gc.pos < gc.cnt; i++, gc.pos++) {
+			cache_entry_t *e = &gc.ent[gc.pos];
+
+			if (fstatat(gc.dirfd, e->path + 1, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+			    (S_ISLNK(st.st_mode) && faccessat(gc.dirfd, e->path + 1, F_OK, 0) < 0 &&
+			     unlinkat(gc.dirfd, e->path + 1, 0) == 0))
+			{
+				free(e->path);
+				e->path = NULL;
 			} else {
-				imlib_image_set_format("jpg");
-				imlib_image_attach_data_value("quality", NULL, 90, NULL);
+				e->link = S_ISLNK(st.st_mode);
+				e->size = e->link ? 0 : st.st_size;
+				e->atime = st.st_atim.tv_sec;
 			}
-			memcpy(cache_tmpfile_base, TMP_NAME, sizeof(TMP_NAME));
-			if ((tmpfd = mkstemp(cache_tmpfile)) < 0)
-				goto end;
-			imlib_save_image_fd(tmpfd, ""); /* NOTE: closes `tmpfd` */
-			err = imlib_get_error();
-			times.actime = fstats.st_atime;
-			times.modtime = fstats.st_mtime;
-			utime(cache_tmpfile, &times);
-			if (err || rename(cache_tmpfile, cfile) < 0)
-				unlink(cache_tmpfile);
 		}
-end:
-		free(cfile);
+		if (gc.pos == gc.cnt) {
+			tns_gc_evict();
+			tns_gc_reset();
+		}
+		break;
 	}
 }
 
+static int strcmp_ptr(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* returns the content file the path entry `cfile` is a symlink to */
+static char *tns_cache_target(const char *cfile, const struct stat *st)
+{
+	char *target = emalloc(st->st_size + 1);
+	ssize_t n = readlink(cfile, target, st->st_size + 1);
+
+	if (n < 0 || n > st->st_size) {
+		free(target);
+		return NULL;
+	}
+	target[n] = '\0';
+	return target;
+}
+
 void tns_clean_cache(void)
 {
 	int dirlen;
-	char *cfile, *filename;
+	char *cfile, *filename, *target, **links = NULL;
+	size_t i, linkcnt = 0, linkcap = 0;
+	struct stat st;
 	r_dir_t dir;
 
 	if (r_opendir(&dir, cache_dir, true) < 0) {
@@ -154,16 +828,240 @@ void tns_clean_cache(void)
 	}
 
 	dirlen = strlen(cache_dir);
+	tns_gc_reset();
 
 	while ((cfile = r_readdir(&dir, true)) != NULL) {
 		filename = cfile + dirlen;
-		if (access(filename, F_OK) < 0) {
+		if (strncmp(filename, CONTENT_DIR, sizeof(CONTENT_DIR) - 1) == 0 ||
+		    STREQ(filename, INDEX_NAME))
+		{
+			/* not a thumbnail */
+		} else if (access(filename, F_OK) < 0) {
 			if (unlink(cfile) < 0)
 				error(0, errno, "%s", cfile);
+		} else if (lstat(cfile, &st) == 0) {
+			if (S_ISLNK(st.st_mode) && (target = tns_cache_target(cfile, &st)) != NULL) {
+				if (linkcnt == linkcap) {
+					linkcap = linkcap > 0 ? linkcap * 2 : 1024;
+					links = erealloc(links, linkcap * sizeof(*links));
+				}
+				links[linkcnt++] = target;
+			}
+			if (tns_cache_bounded())
+				tns_gc_push(filename, &st);
 		}
 		free(cfile);
 	}
 	r_closedir(&dir);
+
+	/* content addressed files without any path linking to them */
+	if (linkcnt > 0)
+		qsort(links, linkcnt, sizeof(*links), strcmp_ptr);
+	filename = tns_cache_subpath(CONTENT_DIR);
+	if (r_opendir(&dir, filename, true) == 0) {
+		while ((cfile = r_readdir(&dir, true)) != NULL) {
+			if (linkcnt == 0 ||
+			    bsearch(&cfile, links, linkcnt, sizeof(*links), strcmp_ptr) == NULL)
+			{
+				if (unlink(cfile) < 0)
+					error(0, errno, "%s", cfile);
+			} else if (tns_cache_bounded() && stat(cfile, &st) == 0) {
+				tns_gc_push(cfile + dirlen, &st);
+			}
+			free(cfile);
+		}
+		r_closedir(&dir);
+	}
+	free(filename);
+	for (i = 0; i < linkcnt; i++)
+		free(links[i]);
+	free(links);
+
+	/* rebuild the index from scratch and enforce the cache limits */
+	if (tns_cache_bounded() &&
+	    (gc.dirfd = open(cache_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0)
+	{
+		tns_gc_evict();
+	}
+	tns_gc_reset();
+}
+
+enum { UC_FAIL, UC_HIT, UC_NEW, UC_SKIP };
+
+typedef struct {
+	int n;
+	int status;
+	off_t size;
+} uc_result_t;
+
+static int tns_cache_update(tns_t *tns, int n, off_t *size)
+{
+	const char *filepath = file_realpath(&tns->files[n], 0);
+	char *cfile;
+	struct stat fstats, cstats;
+	bool hit = false;
+
+	if (filepath == NULL || tns_stat(&src_dirfd, filepath, &fstats) < 0)
+		return UC_FAIL;
+	*size = fstats.st_size;
+	if (!tns_cache_whitelisted(tns, filepath))
+		return UC_SKIP;
+	if ((cfile = tns_cache_filepath(filepath)) != NULL) {
+		hit = tns_stat(&cache_dirfd, cfile, &cstats) == 0 &&
+		      tns_cache_fresh(&fstats, &cstats);
+		free(cfile);
+	}
+	if (hit)
+		return UC_HIT;
+	if (!tns_load(tns, n, false, true))
+		return UC_FAIL;
+	return load_hit ? UC_HIT : UC_NEW; /* the content addressed cache */
+}
+
+static void tns_update_worker(tns_t *tns, int jobfd, int resfd)
+{
+	uc_result_t r;
+
+	writer.sync = true; /* already in the background */
+	while (read(jobfd, &r.n, sizeof(r.n)) == sizeof(r.n)) {
+		r.size = 0;
+		r.status = tns_cache_update(tns, r.n, &r.size);
+		if (write(resfd, &r, sizeof(r)) != sizeof(r))
+			break;
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+static void tns_update_progress(int done, int total, const int *cnt,
+                                off_t bytes, const struct timespec *start, bool last)
+{
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+	secs = MAX(secs, 1e-3);
+	fprintf(stderr, "\r%d/%d files, %.1f files/s, %.1f MB/s, %d%% hits, %d failed%s",
+	        done, total, done / secs, bytes / secs / (1024 * 1024),
+	        done > 0 ? cnt[UC_HIT] * 100 / done : 0, cnt[UC_FAIL], last ? "\n" : "");
+}
+
+/* generates the cache of all files using `jobs` worker processes, since
+ * imlib2 can't be used from multiple threads. an interrupted run is resumed
+ * by the freshness test of the workers, which skip the files cached already.
+ */
+void tns_update_cache(tns_t *tns, int jobs)
+{
+	size_t i;
+	int todocnt = *tns->cnt, jobi = 0, done = 0, cnt[4] = { 0 };
+	int jobfd[2], resfd[2];
+	bool progress = !options->quiet && isatty(STDERR_FILENO);
+	off_t bytes = 0;
+	ssize_t r;
+	uc_result_t res;
+	struct pollfd pfd[2];
+	struct timespec start, shown, now;
+
+	if (todocnt == 0)
+		return;
+	if (jobs <= 0 && (jobs = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+		jobs = 1;
+	jobs = MIN(jobs, todocnt);
+	if (pipe(jobfd) < 0 || pipe(resfd) < 0)
+		error(EXIT_FAILURE, errno, "pipe");
+	fflush(NULL); /* don't duplicate buffered output in the workers */
+	for (i = 0; i < (size_t)jobs; i++) {
+		switch (fork()) {
+		case -1:
+			error(EXIT_FAILURE, errno, "fork");
+			break;
+		case 0:
+			close(jobfd[1]);
+			close(resfd[0]);
+			tns_update_worker(tns, jobfd[0], resfd[1]);
+			break;
+		}
+	}
+	close(jobfd[0]);
+	close(resfd[1]);
+	fcntl(jobfd[1], F_SETFL, O_NONBLOCK);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	shown = start;
+	pfd[0].fd = resfd[0];
+	pfd[0].events = POLLIN;
+	pfd[1].events = POLLOUT;
+	for (;;) {
+		pfd[1].fd = jobi < todocnt ? jobfd[1] : -1;
+		if (poll(pfd, ARRLEN(pfd), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			error(EXIT_FAILURE, errno, "poll");
+		}
+		if (pfd[1].revents & (POLLOUT | POLLERR)) {
+			while (jobi < todocnt && write(jobfd[1], &jobi, sizeof(jobi)) > 0)
+				jobi++;
+			if (jobi == todocnt)
+				close(jobfd[1]);
+		}
+		if (pfd[0].revents & (POLLIN | POLLHUP)) {
+			if ((r = read(resfd[0], &res, sizeof(res))) <= 0) {
+				if (r < 0 && errno == EINTR)
+					continue;
+				break;
+			}
+			assert(r == sizeof(res) && "writes up to PIPE_BUF are atomic");
+			done++;
+			cnt[res.status]++;
+			bytes += res.size;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (progress && now.tv_sec != shown.tv_sec) {
+				tns_update_progress(done, todocnt, cnt, bytes, &start, false);
+				shown = now;
+			}
+		}
+	}
+	close(resfd[0]);
+	if (jobi < todocnt)
+		close(jobfd[1]);
+
+	if (!options->quiet)
+		tns_update_progress(done, todocnt, cnt, bytes, &start, true);
+	if (cnt[UC_NEW] > 0 && tns_cache_bounded()) {
+		gc.writes = 1; /* done by the workers */
+		while (tns_cache_gc_pending())
+			tns_cache_gc();
+	}
+}
+
+/* returns the state of thumbnail `n`, which is stored in pages of TNS_PAGE
+ * that only exist while one of their thumbnails is loaded. NULL if its page
+ * doesn't exist and `alloc` is false.
+ */
+static thumb_t *tns_thumb(tns_t *tns, int n, bool alloc)
+{
+	int p = n / TNS_PAGE;
+
+	if (p >= tns->pagecnt) {
+		if (!alloc)
+			return NULL;
+		tns->thumbs = erealloc(tns->thumbs, (p + 1) * sizeof(*tns->thumbs));
+		memset(tns->thumbs + tns->pagecnt, 0, (p + 1 - tns->pagecnt) * sizeof(*tns->thumbs));
+		tns->pagecnt = p + 1;
+	}
+	if (tns->thumbs[p] == NULL) {
+		if (!alloc)
+			return NULL;
+		tns->thumbs[p] = ecalloc(1, sizeof(*tns->thumbs[p]));
+	}
+	return &tns->thumbs[p]->t[n % TNS_PAGE];
+}
+
+static bool tns_loaded(tns_t *tns, int n)
+{
+	thumb_t *t = tns_thumb(tns, n, false);
+
+	return t != NULL && (t->im != NULL || t->px != NULL);
 }
 
 void tns_init(tns_t *tns, fileinfo_t *tns_files, const int *cnt, int *sel, win_t *win)
@@ -171,18 +1069,32 @@ void tns_init(tns_t *tns, fileinfo_t *tns_files, const int *cnt, int *sel, win_t
 	int len;
 	const char *homedir, *dsuffix = "";
 
-	if (cnt != NULL && *cnt > 0)
-		tns->thumbs = ecalloc(*cnt, sizeof(*tns->thumbs));
-	else
+	if (cnt != NULL && *cnt > 0) {
+		tns->pagecnt = (*cnt + TNS_PAGE - 1) / TNS_PAGE;
+		tns->thumbs = ecalloc(tns->pagecnt, sizeof(*tns->thumbs));
+	} else {
+		tns->pagecnt = 0;
 		tns->thumbs = NULL;
+	}
 	tns->files = tns_files;
 	tns->cnt = cnt;
-	tns->initnext = tns->loadnext = 0;
+	tns->loadnext = 0;
 	tns->first = tns->end = tns->r_first = tns->r_end = 0;
+	tns->scrolldir = DIR_DOWN;
+	tns->loaded = 0;
+	tns->tick = 0;
+	tns->init.sel = -1;
+	tns->init.lo = tns->init.hi = 0;
 	tns->sel = sel;
 	tns->win = win;
 	tns->dirty = false;
 
+	tns->atlas.pm = None;
+	tns->atlas.gc = NULL;
+	tns->atlas.cols = tns->atlas.rows = 0;
+	tns->atlas.next = tns->atlas.freecnt = 0;
+	tns->atlas.free = NULL;
+
 	tns->zl = THUMB_SIZE;
 	tns_zoom(tns, 0);
 
@@ -232,15 +1144,42 @@ void tns_init(tns_t *tns, fileinfo_t *tns_files, const int *cnt, int *sel, win_t
 	}
 }
 
+static CLEANUP void tns_atlas_free(tns_t *tns)
+{
+	if (tns->atlas.pm != None) {
+		XFreePixmap(tns->win->env.dpy, tns->atlas.pm);
+		tns->atlas.pm = None;
+	}
+	free(tns->atlas.free);
+	tns->atlas.free = NULL;
+	tns->atlas.cols = tns->atlas.rows = 0;
+	tns->atlas.next = tns->atlas.freecnt = 0;
+}
+
 CLEANUP void tns_free(tns_t *tns)
 {
-	int i;
+	int i, p;
 
 	if (tns->thumbs != NULL) {
-		for (i = 0; i < *tns->cnt; i++)
-			img_free(tns->thumbs[i].im, false);
+		for (p = 0; p < tns->pagecnt; p++) {
+			if (tns->thumbs[p] == NULL)
+				continue;
+			for (i = 0; i < TNS_PAGE; i++) {
+				img_free(tns->thumbs[p]->t[i].im, false);
+				free(tns->thumbs[p]->t[i].px);
+			}
+			free(tns->thumbs[p]);
+		}
 		free(tns->thumbs);
 		tns->thumbs = NULL;
+		tns->pagecnt = 0;
+		tns->loaded = 0;
+	}
+
+	tns_atlas_free(tns);
+	if (tns->atlas.gc != NULL) {
+		XFreeGC(tns->win->env.dpy, tns->atlas.gc);
+		tns->atlas.gc = NULL;
 	}
 
 	for (i = 0; i < tns->filters_cnt; ++i)
@@ -249,6 +1188,15 @@ CLEANUP void tns_free(tns_t *tns)
 	free(tns->filters);
 	tns->filters = NULL;
 
+	tns_dirfd_close(&src_dirfd);
+	tns_dirfd_close(&cache_dirfd);
+	tns_cache_flush(true);
+	tns_writer_close();
+	tns_gc_reset();
+	if (index_fd >= 0) {
+		close(index_fd);
+		index_fd = -1;
+	}
 	free(cache_dir);
 	cache_dir = NULL;
 	free(cache_tmpfile);
@@ -279,28 +1227,76 @@ static Imlib_Image tns_scale_down(Imlib_Image im, int dim)
 	return im;
 }
 
+/* packs the current image into RGB565, with a 4x4 ordered dither hiding the
+ * banding of the reduced color depth.
+ */
+static uint16_t *tns_compact(int w, int h)
+{
+	static const unsigned char bayer[4][4] = {
+		{  0,  8,  2, 10 }, { 12,  4, 14,  6 },
+		{  3, 11,  1,  9 }, { 15,  7, 13,  5 }
+	};
+	const uint32_t *src = imlib_image_get_data_for_reading_only();
+	uint16_t *px = emalloc((size_t)w * h * sizeof(*px));
+	unsigned int r, g, b, d;
+	int x, y;
+
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++, src++) {
+			d = bayer[y & 3][x & 3];
+			r = MIN(((*src >> 16) & 0xff) + (d >> 1), 0xff) >> 3;
+			g = MIN(((*src >> 8) & 0xff) + (d >> 2), 0xff) >> 2;
+			b = MIN((*src & 0xff) + (d >> 1), 0xff) >> 3;
+			px[y * w + x] = r << 11 | g << 5 | b;
+		}
+	}
+	return px;
+}
+
+static Imlib_Image tns_expand(const thumb_t *t)
+{
+	Imlib_Image im;
+	uint32_t *dst, r, g, b;
+	int i;
+
+	if ((im = imlib_create_image(t->w, t->h)) == NULL)
+		return NULL;
+	imlib_context_set_image(im);
+	dst = imlib_image_get_data();
+	for (i = 0; i < t->w * t->h; i++) {
+		r = t->px[i] >> 11;
+		g = (t->px[i] >> 5) & 0x3f;
+		b = t->px[i] & 0x1f;
+		dst[i] = 0xffu << 24 | (r << 3 | r >> 2) << 16 |
+		         (g << 2 | g >> 4) << 8 | (b << 3 | b >> 2);
+	}
+	imlib_image_put_back_data(dst);
+	return im;
+}
+
 bool tns_load(tns_t *tns, int n, bool force, bool cache_only)
 {
 	int maxwh = thumb_sizes[ARRLEN(thumb_sizes) - 1];
-	bool cache_hit = false;
 	char *cfile;
 	thumb_t *t;
 	fileinfo_t *file;
 	Imlib_Image im = NULL;
 	const char *filepath;
+	struct stat st, *fstats = &st;
 
+	load_hit = false;
 	if (n < 0 || n >= *tns->cnt)
 		return false;
 	file = &tns->files[n];
 	if (file->name == NULL || (filepath = file_realpath(file, 0)) == NULL)
 		return false;
+	if (tns_stat(&src_dirfd, filepath, fstats) < 0)
+		fstats = NULL;
 
-	t = &tns->thumbs[n];
-	img_free(t->im, false);
-	t->im = NULL;
+	tns_unload(tns, n);
 
 	if (!force) {
-		if ((im = tns_cache_load(filepath, &force)) != NULL) {
+		if ((im = tns_cache_load(tns, filepath, fstats, &force)) != NULL) {
 			imlib_context_set_image(im);
 			if (imlib_image_get_width() < maxwh &&
 			    imlib_image_get_height() < maxwh)
@@ -312,7 +1308,7 @@ bool tns_load(tns_t *tns, int n, bool force, bool cache_only)
 				imlib_free_image_and_decache();
 				im = NULL;
 			} else {
-				cache_hit = true;
+				load_hit = true;
 			}
 #if HAVE_LIBEXIF
 		} else if (!force && !options->private_mode) {
@@ -368,38 +1364,44 @@ bool tns_load(tns_t *tns, int n, bool force, bool cache_only)
 	}
 
 	if (im == NULL) {
-		if ((im = img_open(file)) == NULL)
+		if ((im = img_open_thumb(file, maxwh)) == NULL)
 			return false;
 	}
 	imlib_context_set_image(im);
 
-	if (!cache_hit) {
+	if (!load_hit) {
 #if HAVE_LIBEXIF
 		exif_auto_orientate(file);
 #endif
 		im = tns_scale_down(im, maxwh);
 		imlib_context_set_image(im);
 		if (imlib_image_get_width() == maxwh || imlib_image_get_height() == maxwh)
-			tns_cache_write(tns, im, filepath, true);
+			tns_cache_write(tns, im, filepath, fstats, true);
 	}
 
 	if (cache_only) {
 		imlib_free_image_and_decache();
 	} else {
+		t = tns_thumb(tns, n, true);
 		t->im = tns_scale_down(im, thumb_sizes[tns->zl]);
 		imlib_context_set_image(t->im);
 		t->w = imlib_image_get_width();
 		t->h = imlib_image_get_height();
+		if (THUMB_COMPACT && !imlib_image_has_alpha()) {
+			t->px = tns_compact(t->w, t->h);
+			imlib_free_image();
+			t->im = NULL;
+		}
+		t->used = tns->tick;
+		tns->thumbs[n / TNS_PAGE]->loaded++;
+		tns->loaded++;
 		tns->dirty = true;
 	}
 	file->flags |= FF_TN_INIT;
 
-	if (n == tns->initnext) {
-		while (++tns->initnext < *tns->cnt && ((++file)->flags & FF_TN_INIT))
-			;
-	}
 	if (n == tns->loadnext && !cache_only) {
-		while (++tns->loadnext < tns->end && (++t)->im != NULL)
+		while (++tns->loadnext < tns->end && (tns_loaded(tns, tns->loadnext) ||
+		       (tns->files[tns->loadnext].flags & FF_REMOVED)))
 			;
 	}
 
@@ -409,12 +1411,318 @@ bool tns_load(tns_t *tns, int n, bool force, bool cache_only)
 void tns_unload(tns_t *tns, int n)
 {
 	thumb_t *t;
+	struct tns_page **page;
 
 	assert(n >= 0 && n < *tns->cnt);
-	t = &tns->thumbs[n];
+	if (!tns_loaded(tns, n))
+		return;
 
+	t = tns_thumb(tns, n, false);
 	img_free(t->im, false);
 	t->im = NULL;
+	free(t->px);
+	t->px = NULL;
+	if (t->slot > 0) {
+		tns->atlas.free[tns->atlas.freecnt++] = t->slot - 1;
+		t->slot = 0;
+	}
+	tns->loaded--;
+	page = &tns->thumbs[n / TNS_PAGE];
+	if (--(*page)->loaded == 0) {
+		free(*page);
+		*page = NULL;
+	}
+}
+
+/* moves the thumbnails after `n` one position down for the removal of file
+ * `n`, only touching the pages which exist.
+ */
+void tns_remove(tns_t *tns, int n)
+{
+	int p, i = n % TNS_PAGE;
+	struct tns_page *page, *next;
+
+	tns_unload(tns, n);
+	for (p = n / TNS_PAGE; p < tns->pagecnt; p++, i = 0) {
+		page = tns->thumbs[p];
+		next = p + 1 < tns->pagecnt ? tns->thumbs[p + 1] : NULL;
+		if (page != NULL) {
+			memmove(page->t + i, page->t + i + 1, (TNS_PAGE - 1 - i) * sizeof(*page->t));
+			memset(&page->t[TNS_PAGE - 1], 0, sizeof(*page->t));
+		}
+		if (next != NULL && (next->t[0].im != NULL || next->t[0].px != NULL)) {
+			if (page == NULL)
+				page = tns->thumbs[p] = ecalloc(1, sizeof(*page));
+			page->t[TNS_PAGE - 1] = next->t[0];
+			page->loaded++;
+			next->loaded--;
+			memset(&next->t[0], 0, sizeof(*next->t));
+		}
+		if (page != NULL && page->loaded == 0) {
+			free(page);
+			tns->thumbs[p] = NULL;
+		}
+	}
+}
+
+/* moves the thumbnails from `n` on up by one for the file which has been
+ * inserted at `n`, the counterpart of tns_remove().
+ */
+void tns_insert(tns_t *tns, int n)
+{
+	int p, i;
+	thumb_t *last;
+	struct tns_page *page;
+
+	for (p = tns->pagecnt - 1; p >= n / TNS_PAGE; p--) {
+		if ((page = tns->thumbs[p]) == NULL)
+			continue;
+		i = p == n / TNS_PAGE ? n % TNS_PAGE : 0;
+		last = &page->t[TNS_PAGE - 1];
+		if (last->im != NULL || last->px != NULL) {
+			/* the next page has been moved up already, its first slot is free */
+			*tns_thumb(tns, (p + 1) * TNS_PAGE, true) = *last;
+			tns->thumbs[p + 1]->loaded++;
+			page->loaded--;
+		}
+		memmove(page->t + i + 1, page->t + i, (TNS_PAGE - 1 - i) * sizeof(*page->t));
+		memset(&page->t[i], 0, sizeof(*page->t));
+		if (page->loaded == 0) {
+			free(page);
+			tns->thumbs[p] = NULL;
+		}
+	}
+}
+
+/* moves the thumbnails of the files which are kept down over the ones of the
+ * files flagged FF_REMOVED, which are unloaded already, in a single pass.
+ */
+void tns_remove_flagged(tns_t *tns)
+{
+	int i, j;
+	thumb_t *t;
+	struct tns_page **page;
+
+	for (i = j = 0; i < *tns->cnt; i++) {
+		if (tns->files[i].flags & FF_REMOVED)
+			continue;
+		if (i != j && tns_loaded(tns, i)) {
+			t = tns_thumb(tns, i, false);
+			*tns_thumb(tns, j, true) = *t;
+			tns->thumbs[j / TNS_PAGE]->loaded++;
+			memset(t, 0, sizeof(*t));
+			page = &tns->thumbs[i / TNS_PAGE];
+			if (--(*page)->loaded == 0) {
+				free(*page);
+				*page = NULL;
+			}
+		}
+		j++;
+	}
+}
+
+int tns_next(tns_t *tns)
+{
+	int i, end, n = tns->cols * tns->rows * THUMB_LOOKAHEAD;
+	const int sel = *tns->sel;
+
+	/* files which failed to load are only flagged until compact_files() */
+	while (tns->loadnext < tns->end && (tns->files[tns->loadnext].flags & FF_REMOVED))
+		tns->loadnext++;
+	if (tns->loadnext < tns->end)
+		return tns->loadnext;
+
+	/* look ahead in the direction the view last moved to */
+	if (tns->scrolldir == DIR_UP) {
+		for (i = tns->first - 1, end = MAX(tns->first - n, 0); i >= end; i--) {
+			if (!(tns->files[i].flags & FF_TN_INIT))
+				return i;
+		}
+	} else {
+		for (i = tns->end, end = MIN(tns->end + n, *tns->cnt); i < end; i++) {
+			if (!(tns->files[i].flags & FF_TN_INIT))
+				return i;
+		}
+	}
+
+	/* cache everything else, outward from the selection */
+	if (tns->init.sel != sel) {
+		tns->init.sel = sel;
+		tns->init.lo = tns->init.hi = sel;
+	}
+	while (tns->init.hi < *tns->cnt && (tns->files[tns->init.hi].flags & FF_TN_INIT))
+		tns->init.hi++;
+	while (tns->init.lo >= 0 && (tns->files[tns->init.lo].flags & FF_TN_INIT))
+		tns->init.lo--;
+
+	if (tns->init.hi < *tns->cnt &&
+	    (tns->init.lo < 0 || tns->init.hi - sel <= sel - tns->init.lo))
+	{
+		return tns->init.hi;
+	}
+	return tns->init.lo;
+}
+
+typedef struct {
+	int n;
+	unsigned int used;
+} tns_lru_t;
+
+static int tns_cmp_used(const void *a, const void *b)
+{
+	const tns_lru_t *ta = a, *tb = b;
+
+	return (ta->used > tb->used) - (ta->used < tb->used);
+}
+
+/* unloads the least recently visible thumbnails outside of [first, end) once
+ * more than THUMB_RETAIN screens of them are kept in addition to one screen.
+ * one more screen than necessary is dropped, so that scrolling doesn't search
+ * for the thumbnails to unload on every step.
+ */
+static void tns_retain(tns_t *tns, int first, int end, int screen)
+{
+	int i, p, n = 0;
+	int max = screen * (1 + MAX(THUMB_RETAIN, 0));
+	tns_lru_t *lru;
+
+	if (tns->loaded <= max)
+		return;
+	lru = emalloc(tns->loaded * sizeof(*lru));
+	for (p = 0; p < tns->pagecnt; p++) {
+		for (i = p * TNS_PAGE; tns->thumbs[p] != NULL && i < (p + 1) * TNS_PAGE; i++) {
+			thumb_t *t = &tns->thumbs[p]->t[i % TNS_PAGE];
+
+			if ((t->im != NULL || t->px != NULL) && (i < first || i >= end)) {
+				lru[n].used = t->used;
+				lru[n++].n = i;
+			}
+		}
+	}
+	qsort(lru, n, sizeof(*lru), tns_cmp_used);
+	for (i = 0; i < n && tns->loaded > max - screen; i++)
+		tns_unload(tns, lru[i].n);
+	free(lru);
+}
+
+/* returns the next file to create a thumbnail for while idle in image mode,
+ * only the ones within THUMB_PREFETCH screens of the selection are kept in
+ * memory for the switch to thumbnail mode, but no more than the retention
+ * limit allows. the others are skipped if they would not be written to the
+ * cache either.
+ */
+int tns_prefetch(tns_t *tns, bool *cache_only)
+{
+	int n, screen, keep;
+	const int sel = *tns->sel;
+	const char *filepath;
+
+	if (THUMB_PREFETCH < 0)
+		return -1;
+	screen = MAX(1, tns->win->w / tns->dim) * MAX(1, tns->win->h / tns->dim);
+	keep = MIN(screen * THUMB_PREFETCH, screen * MAX(THUMB_RETAIN, 0) / 2);
+	/* nothing is rendered in image mode, which unloads them otherwise */
+	tns_retain(tns, sel - keep + 1, sel + keep, screen);
+	while ((n = tns_next(tns)) >= 0) {
+		*cache_only = ABS(n - sel) >= keep;
+		if (!*cache_only)
+			return n;
+		if (options->private_mode)
+			return -1;
+		if ((filepath = file_realpath(&tns->files[n], 0)) == NULL ||
+		    tns_cache_whitelisted(tns, filepath))
+		{
+			return n;
+		}
+		tns->files[n].flags |= FF_TN_INIT;
+	}
+	return -1;
+}
+
+void tns_atlas_reset(tns_t *tns)
+{
+	int i, p;
+
+	for (p = 0; p < tns->pagecnt; p++) {
+		for (i = 0; tns->thumbs[p] != NULL && i < TNS_PAGE; i++)
+			tns->thumbs[p]->t[i].slot = 0;
+	}
+	tns->atlas.next = tns->atlas.freecnt = 0;
+}
+
+static int tns_atlas_alloc(tns_t *tns)
+{
+	int rows, size = thumb_sizes[tns->zl];
+	win_t *win = tns->win;
+	Pixmap pm;
+
+	if (tns->atlas.freecnt > 0)
+		return tns->atlas.free[--tns->atlas.freecnt];
+
+	if (tns->atlas.next == tns->atlas.cols * tns->atlas.rows) {
+		/* grow by at least one screen worth of thumbnails */
+		if (tns->atlas.cols == 0)
+			tns->atlas.cols = MAX(ATLAS_WIDTH / size, 1);
+		rows = tns->atlas.rows + MAX(tns->atlas.rows,
+		       (tns->cols * tns->rows + tns->atlas.cols - 1) / tns->atlas.cols);
+		rows = MIN(rows, SHRT_MAX / size);
+		if (rows <= tns->atlas.rows)
+			return -1;
+
+		pm = XCreatePixmap(win->env.dpy, win->xwin, tns->atlas.cols * size,
+		                   rows * size, win->env.depth);
+		if (tns->atlas.gc == NULL) {
+			XGCValues gcval;
+			gcval.graphics_exposures = False;
+			tns->atlas.gc = XCreateGC(win->env.dpy, pm, GCGraphicsExposures, &gcval);
+		}
+		if (tns->atlas.pm != None) {
+			XCopyArea(win->env.dpy, tns->atlas.pm, pm, tns->atlas.gc, 0, 0,
+			          tns->atlas.cols * size, tns->atlas.rows * size, 0, 0);
+			XFreePixmap(win->env.dpy, tns->atlas.pm);
+		}
+		tns->atlas.pm = pm;
+		tns->atlas.rows = rows;
+		tns->atlas.free = erealloc(tns->atlas.free,
+		                           tns->atlas.cols * rows * sizeof(*tns->atlas.free));
+	}
+	return tns->atlas.next++;
+}
+
+static void tns_draw_thumb(tns_t *tns, thumb_t *t)
+{
+	int slot, sx, sy, size = thumb_sizes[tns->zl];
+	win_t *win = tns->win;
+	Imlib_Image im = t->im;
+
+	if (t->slot == 0) {
+		/* compacted thumbnails are only expanded until they are uploaded */
+		if (im == NULL && (im = tns_expand(t)) == NULL)
+			return;
+		imlib_context_set_image(im);
+	}
+	if (t->slot == 0 && (slot = tns_atlas_alloc(tns)) >= 0) {
+		/* upload the thumbnail to the server once, on top of the window background */
+		t->slot = slot + 1;
+		sx = slot % tns->atlas.cols * size;
+		sy = slot / tns->atlas.cols * size;
+		XSetForeground(win->env.dpy, tns->atlas.gc, win->win_bg.pixel);
+		XFillRectangle(win->env.dpy, tns->atlas.pm, tns->atlas.gc, sx, sy, size, size);
+		imlib_context_set_drawable(tns->atlas.pm);
+		imlib_render_image_on_drawable_at_size(sx, sy, t->w, t->h);
+	}
+	if (t->slot > 0) {
+		sx = (t->slot - 1) % tns->atlas.cols * size;
+		sy = (t->slot - 1) / tns->atlas.cols * size;
+		XCopyArea(win->env.dpy, tns->atlas.pm, win->buf.pm, tns->atlas.gc,
+		          sx, sy, t->w, t->h, t->x, t->y);
+	} else {
+		/* atlas is full, render directly into the window buffer */
+		imlib_context_set_drawable(win->buf.pm);
+		imlib_render_image_on_drawable_at_size(t->x, t->y, t->w, t->h);
+	}
+	if (im != t->im)
+		img_free(im, false);
 }
 
 static void tns_check_view(tns_t *tns, bool scrolled)
@@ -443,18 +1751,34 @@ static void tns_check_view(tns_t *tns, bool scrolled)
 	}
 }
 
+/* returns the range of files around the visible ones, whose thumbnails are
+ * kept in memory for scrolling back within THUMB_RETAIN screens.
+ */
+void tns_range(const tns_t *tns, int *first, int *end)
+{
+	int retain = tns->cols * tns->rows * MAX(THUMB_RETAIN, 0);
+
+	*first = MAX(tns->first - retain, 0);
+	*end = MIN(tns->end + retain, *tns->cnt);
+}
+
 void tns_render(tns_t *tns)
 {
 	thumb_t *t;
 	win_t *win;
-	int i, cnt, r, x, y;
+	int i, cnt, r, x, y, ox, oy, cx, cw, shift = 0;
+	bool redraw;
 
-	if (!tns->dirty)
+	if (!tns->dirty && tns->first == tns->r_first)
 		return;
 
+	/* directories might have been replaced since the last batch of loads */
+	tns_dirfd_close(&src_dirfd);
+	tns_dirfd_close(&cache_dirfd);
+
 	win = tns->win;
-	win_clear(win);
-	imlib_context_set_drawable(win->buf.pm);
+	ox = tns->x;
+	oy = tns->y;
 
 	tns->cols = MAX(1, win->w / tns->dim);
 	tns->rows = MAX(1, win->h / tns->dim);
@@ -476,25 +1800,54 @@ void tns_render(tns_t *tns)
 	             (win->bar.top ? win->bar.h : 0);
 	tns->loadnext = *tns->cnt;
 	tns->end = tns->first + cnt;
+	if (tns->first != tns->r_first)
+		tns->scrolldir = tns->first > tns->r_first ? DIR_DOWN : DIR_UP;
+
+	if (!tns->dirty && tns->x == ox && tns->y == oy)
+		shift = (tns->r_first - tns->first) / tns->cols;
+	if (shift != 0 && ABS(shift) < tns->rows) {
+		/* only scrolled: move the still visible rows, draw the revealed ones */
+		cx = tns->x - tns->bw - 3;
+		cw = tns->cols * tns->dim;
+		oy = tns->y - tns->bw - 3;
+		r = (tns->rows - ABS(shift)) * tns->dim;
+		if (shift > 0) {
+			win_copy_area(win, cx, oy, cw, r, cx, oy + shift * tns->dim);
+			win_draw_rect(win, cx, oy, cw, shift * tns->dim, true, 1, win->win_bg.pixel);
+		} else {
+			win_copy_area(win, cx, oy - shift * tns->dim, cw, r, cx, oy);
+			win_draw_rect(win, cx, oy + r, cw, -shift * tns->dim, true, 1,
+			              win->win_bg.pixel);
+		}
+	} else {
+		shift = 0;
+		win_clear(win);
+	}
 
-	for (i = tns->r_first; i < tns->r_end; i++) {
-		if ((i < tns->first || i >= tns->end) && tns->thumbs[i].im != NULL)
-			tns_unload(tns, i);
+	tns->tick++;
+	for (i = tns->first; i < tns->end; i++) {
+		if ((t = tns_thumb(tns, i, false)) != NULL)
+			t->used = tns->tick;
 	}
+	tns_retain(tns, tns->first, tns->end, tns->cols * tns->rows);
 	tns->r_first = tns->first;
 	tns->r_end = tns->end;
 
 	for (i = tns->first; i < tns->end; i++) {
-		t = &tns->thumbs[i];
-		(void)file_realpath(&tns->files[i], 1);
-		if (t->im != NULL && !(tns->files[i].flags & FF_TN_NEEDS_UPDATE)) {
+		t = tns_thumb(tns, i, false);
+		r = (i - tns->first) / tns->cols;
+		redraw = shift == 0 || r < shift || r >= tns->rows + shift;
+		if (redraw)
+			(void)file_realpath(&tns->files[i], 1);
+		if (tns_loaded(tns, i) && !(tns->files[i].flags & FF_TN_NEEDS_UPDATE)) {
 			t->x = x + (thumb_sizes[tns->zl] - t->w) / 2;
 			t->y = y + (thumb_sizes[tns->zl] - t->h) / 2;
-			imlib_context_set_image(t->im);
-			imlib_render_image_on_drawable_at_size(t->x, t->y, t->w, t->h);
-			if (tns->files[i].flags & FF_MARK)
-				tns_mark(tns, i, true);
-		} else {
+			if (redraw) {
+				tns_draw_thumb(tns, t);
+				if (tns->files[i].flags & FF_MARK)
+					tns_mark(tns, i, true);
+			}
+		} else if (!(tns->files[i].flags & FF_REMOVED)) {
 			tns_unload(tns, i);
 			tns->loadnext = MIN(tns->loadnext, i);
 			tns->files[i].flags &= ~FF_TN_NEEDS_UPDATE;
@@ -512,9 +1865,9 @@ void tns_render(tns_t *tns)
 
 void tns_mark(tns_t *tns, int n, bool mark)
 {
-	if (n >= 0 && n < *tns->cnt && tns->thumbs[n].im != NULL) {
+	if (n >= 0 && n < *tns->cnt && tns_loaded(tns, n)) {
 		win_t *win = tns->win;
-		thumb_t *t = &tns->thumbs[n];
+		thumb_t *t = tns_thumb(tns, n, false);
 		unsigned long col = win->win_bg.pixel;
 		int x = t->x + t->w, y = t->y + t->h;
 
@@ -533,9 +1886,9 @@ void tns_mark(tns_t *tns, int n, bool mark)
 
 void tns_highlight(tns_t *tns, int n, bool hl)
 {
-	if (n >= 0 && n < *tns->cnt && tns->thumbs[n].im != NULL) {
+	if (n >= 0 && n < *tns->cnt && tns_loaded(tns, n)) {
 		win_t *win = tns->win;
-		thumb_t *t = &tns->thumbs[n];
+		thumb_t *t = tns_thumb(tns, n, false);
 		unsigned long col = hl ? win->win_fg.pixel : win->win_bg.pixel;
 		int oxy = (tns->bw + 1) / 2 + 1, owh = tns->bw + 2;
 
@@ -597,8 +1950,9 @@ bool tns_scroll(tns_t *tns, direction_t dir, bool screen)
 	}
 
 	if (tns->first != old) {
+		/* tns_render() moves the visible rows, so the old highlight must go */
+		tns_highlight(tns, *tns->sel, false);
 		tns_check_view(tns, true);
-		tns->dirty = true;
 	}
 	return tns->first != old;
 }
@@ -619,6 +1973,7 @@ bool tns_zoom(tns_t *tns, int d)
 	if (tns->zl != oldzl) {
 		for (i = 0; i < *tns->cnt; i++)
 			tns_unload(tns, i);
+		tns_atlas_free(tns);
 		tns->dirty = true;
 	}
 	return tns->zl != oldzl;
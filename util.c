@@ -17,11 +17,15 @@
  * along with nsxiv.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* for the d_type of directory entries, which is not part of POSIX */
+#define _DEFAULT_SOURCE
+
 #include "nsxiv.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdarg.h>
@@ -76,6 +80,90 @@ char *estrndup(const char *s, size_t n)
 	return ptr;
 }
 
+enum { STRCHUNK = 64 * 1024 };
+
+struct strchunk {
+	struct strchunk *next;
+	char s[];
+};
+
+static struct {
+	struct strchunk *chunks;
+	char *p;
+	size_t left;
+	size_t used, dead; /* bytes handed out, and given back of those */
+} strings;
+
+static char *arena_chunk(size_t size)
+{
+	struct strchunk *c = emalloc(sizeof(*c) + size);
+
+	c->next = strings.chunks;
+	strings.chunks = c;
+	return c->s;
+}
+
+/* copies `n` bytes of `s` and a terminating null byte into chunks of storage,
+ * for the names and paths of the files which mostly live as long as the file
+ * list itself. this saves the per-allocation overhead of malloc and keeps
+ * neighbouring entries next to each other in memory.
+ */
+char *arena_strndup(const char *s, size_t n)
+{
+	char *d;
+
+	if (n + 1 > STRCHUNK / 8) {
+		d = arena_chunk(n + 1); /* long strings get a chunk of their own */
+	} else {
+		if (n + 1 > strings.left) {
+			strings.p = arena_chunk(STRCHUNK);
+			strings.left = STRCHUNK;
+		}
+		d = strings.p;
+		strings.p += n + 1;
+		strings.left -= n + 1;
+	}
+	memcpy(d, s, n);
+	d[n] = '\0';
+	strings.used += n + 1;
+	return d;
+}
+
+/* marks string `s` of arena_strndup() as unused, its storage is reclaimed by
+ * the next arena_compact() which finds enough of them.
+ */
+void arena_free(const char *s)
+{
+	if (s != NULL)
+		strings.dead += strlen(s) + 1;
+}
+
+/* once more than half of the storage is unused, moves the names and paths of
+ * the `cnt` files of `list` to new chunks and frees the old ones.
+ */
+void arena_compact(fileinfo_t *list, int cnt)
+{
+	struct strchunk *old = strings.chunks, *next;
+	int i;
+
+	if (strings.dead * 2 <= strings.used)
+		return;
+	memset(&strings, 0, sizeof(strings));
+	for (i = 0; i < cnt; i++) {
+		const char *name = list[i].name;
+
+		list[i].name = arena_strndup(name, strlen(name));
+		if (list[i].path == name)
+			list[i].path = list[i].name;
+		else if (list[i].path != NULL)
+			list[i].path = arena_strndup(list[i].path, strlen(list[i].path));
+	}
+	for (; old != NULL; old = next) {
+		next = old->next;
+		free(old);
+	}
+}
+
 void error(int eval, int err, const char *fmt, ...)
 {
 	va_list ap;
@@ -97,6 +185,16 @@ void error(int eval, int err, const char *fmt, ...)
 		exit(eval);
 }
 
+/* bumped whenever a symlink might have been changed, the paths which were
+ * resolved in the current generation are still valid.
+ */
+static unsigned int pathgen = 1;
+
+void file_realpath_invalidate(void)
+{
+	pathgen++;
+}
+
 const char *file_realpath(const fileinfo_t *file, bool invalidate_symlinks)
 {
 	bool use_cached, need_refresh = false;
@@ -104,10 +202,12 @@ const char *file_realpath(const fileinfo_t *file, bool invalidate_symlinks)
 
 	assert(file != NULL);
 
-	use_cached = file->path != NULL && !invalidate_symlinks;
+	use_cached = file->path != NULL && (!invalidate_symlinks || file->pathgen == pathgen);
 	if (!use_cached) {
 		struct stat lst;
 		bool was_symlink = file->flags & FF_SYMLINK;
+
+		mutable->pathgen = pathgen;
 		if (lstat(file->name, &lst) == 0 && S_ISLNK(lst.st_mode))
 			mutable->flags |= FF_SYMLINK;
 		else
@@ -116,7 +216,7 @@ const char *file_realpath(const fileinfo_t *file, bool invalidate_symlinks)
 		               (invalidate_symlinks && (was_symlink || (file->flags & FF_SYMLINK)));
 	}
 	if (need_refresh) {
-		char *newpath = realpath(file->name, NULL);
+		char buf[PATH_MAX], *newpath = realpath(file->name, buf);
 		if (newpath == NULL) {
 			if (file->flags & FF_WARN)
 				error(0, errno, "%s", file->name);
@@ -125,10 +225,15 @@ const char *file_realpath(const fileinfo_t *file, bool invalidate_symlinks)
 			if (invalidate_symlinks && file->path != NULL) {
 				mutable->flags |= FF_TN_NEEDS_UPDATE;
 			}
-			free((void *)mutable->path);
-			mutable->path = newpath;
-		} else {
-			free(newpath);
+			/* absolute names mostly are their own real path already */
+			if (file->path != file->name)
+				arena_free(file->path);
+			if (newpath != NULL && STREQ(newpath, file->name))
+				mutable->path = file->name;
+			else if (newpath != NULL)
+				mutable->path = arena_strndup(newpath, strlen(newpath));
+			else
+				mutable->path = NULL;
 		}
 	}
 	return file->path;
@@ -150,6 +255,7 @@ int r_opendir(r_dir_t *rdir, const char *dirname, bool recursive)
 	rdir->stlen = 0;
 
 	rdir->name = (char *)dirname;
+	rdir->len = strlen(dirname);
 	rdir->d = 0;
 	rdir->recursive = recursive;
 
@@ -180,12 +286,29 @@ int r_closedir(r_dir_t *rdir)
 	return ret;
 }
 
+/* returns whether the entry is a directory, only stat()ing the entries whose
+ * type isn't known from the directory listing itself, or -1 if it's gone.
+ */
+static int r_isdir(DIR *dir, const struct dirent *dentry)
+{
+	struct stat fstats;
+
+#ifdef DT_UNKNOWN
+	if (dentry->d_type != DT_UNKNOWN && dentry->d_type != DT_LNK)
+		return dentry->d_type == DT_DIR;
+#endif
+	if (fstatat(dirfd(dir), dentry->d_name, &fstats, 0) < 0)
+		return -1;
+	return S_ISDIR(fstats.st_mode);
+}
+
 char *r_readdir(r_dir_t *rdir, bool include_hidden)
 {
 	size_t len;
+	int isdir;
+	bool sep;
 	char *filename;
 	struct dirent *dentry;
-	struct stat fstats;
 
 	while (true) {
 		if (rdir->dir != NULL && (dentry = readdir(rdir->dir)) != NULL) {
@@ -198,17 +321,17 @@ char *r_readdir(r_dir_t *rdir, bool include_hidden)
 					continue;
 			}
 
-			len = strlen(rdir->name) + strlen(dentry->d_name) + 2;
-			filename = emalloc(len);
-			snprintf(filename, len, "%s%s%s", rdir->name,
-			         rdir->name[strlen(rdir->name) - 1] == '/' ? "" : "/",
-			         dentry->d_name);
-
-			if (stat(filename, &fstats) < 0) {
-				free(filename);
+			if ((isdir = r_isdir(rdir->dir, dentry)) < 0)
 				continue;
-			}
-			if (S_ISDIR(fstats.st_mode)) {
+
+			sep = rdir->name[rdir->len - 1] != '/';
+			len = strlen(dentry->d_name) + 1;
+			filename = emalloc(rdir->len + sep + len);
+			memcpy(filename, rdir->name, rdir->len);
+			filename[rdir->len] = '/';
+			memcpy(filename + rdir->len + sep, dentry->d_name, len);
+
+			if (isdir) {
 				/* put subdirectory on the stack */
 				if (rdir->stlen == rdir->stcap) {
 					rdir->stcap *= 2;
@@ -228,6 +351,7 @@ char *r_readdir(r_dir_t *rdir, bool include_hidden)
 			if (rdir->d != 0)
 				free(rdir->name);
 			rdir->name = rdir->stack[--rdir->stlen];
+			rdir->len = strlen(rdir->name);
 			rdir->d = 1;
 			if ((rdir->dir = opendir(rdir->name)) == NULL)
 				error(0, errno, "%s", rdir->name);
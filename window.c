@@ -281,6 +281,7 @@ void win_open(win_t *win)
 	*cnone = XCreatePixmapCursor(e->dpy, none, none, &col, &col, 0, 0);
 
 	gc = XCreateGC(e->dpy, win->xwin, 0, None);
+	XSetGraphicsExposures(e->dpy, gc, False);
 
 	n = icons[ARRLEN(icons) - 1].size;
 	icon_data = emalloc((n * n + 2) * sizeof(*icon_data));
@@ -536,6 +537,11 @@ void win_draw_rect(win_t *win, int x, int y, int w, int h, bool fill, int lw,
 		XDrawRectangle(win->env.dpy, win->buf.pm, gc, x, y, w, h);
 }
 
+void win_copy_area(win_t *win, int sx, int sy, int w, int h, int dx, int dy)
+{
+	XCopyArea(win->env.dpy, win->buf.pm, win->buf.pm, gc, sx, sy, w, h, dx, dy);
+}
+
 void win_set_title(win_t *win, const char *title, size_t len)
 {
 	int i, targets[] = { ATOM_WM_NAME, ATOM_WM_ICON_NAME, ATOM__NET_WM_NAME, ATOM__NET_WM_ICON_NAME };